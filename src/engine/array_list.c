@@ -18,7 +18,8 @@ void *array_list_emplace(struct array_list *list, size_t len, size_t elem_size)
 {
     list->len += len;
     if (list->len > list->allocated_len) {
-        list->allocated_len *= 2;
+        while (list->len > list->allocated_len)
+            list->allocated_len = list->allocated_len ? list->allocated_len * 2 : list->len;
         list->elems = realloc(list->elems, elem_size * list->allocated_len);
     }
 
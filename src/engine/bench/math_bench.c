@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "engine/system/time.h"
+#include "engine/random.h"
+#include "engine/math.h"
+
+#define BENCH_SAMPLES   1024
+#define BENCH_TOLERANCE 1e-4f
+
+/* The scalar kernels math.c shipped before it grew SIMD paths, kept as the reference */
+static mat4 ref_mult(mat4 a, mat4 b)
+{
+    mat4 result;
+    int col, row, k;
+
+    for (row = 0; row < 4; ++row) {
+        for (col = 0; col < 4; ++col) {
+            result.m[row][col] = 0.0f;
+            for (k = 0; k < 4; ++k)
+                result.m[row][col] += a.m[row][k] * b.m[k][col];
+        }
+    }
+    return result;
+}
+static mat4 ref_invert(mat4 mat)
+{
+    mat4 result = MAT4_IDENTITY;
+    int pivot_row, pivot_col;
+    int row, col;
+    float temp, pivot, factor;
+
+    for (pivot_col = 0; pivot_col < 4; pivot_col++) {
+        pivot_row = pivot_col;
+        for (row = pivot_col+1; row < 4; row++)
+            if (fabsf(mat.m[row][pivot_col]) > fabsf(mat.m[pivot_row][pivot_col]))
+                pivot_row = row;
+
+        if (pivot_row != pivot_col) {
+            for (col = 0; col < 4; col++) {
+                temp = mat.m[pivot_col][col];
+                mat.m[pivot_col][col] = mat.m[pivot_row][col];
+                mat.m[pivot_row][col] = temp;
+                temp = result.m[pivot_col][col];
+                result.m[pivot_col][col] = result.m[pivot_row][col];
+                result.m[pivot_row][col] = temp;
+            }
+            pivot_row = pivot_col;
+        }
+
+        pivot = mat.m[pivot_row][pivot_col];
+        if (pivot == 0)
+            return MAT4_IDENTITY;
+
+        for (col = 0; col < 4; col++) {
+            mat.m[pivot_row][col] /= pivot;
+            result.m[pivot_row][col] /= pivot;
+        }
+        for (row = 0; row < 4; row++) {
+            if (row == pivot_row)
+                continue;
+            factor = mat.m[row][pivot_col];
+            for (col = 0; col < 4; col++) {
+                mat.m[row][col] -= factor * mat.m[pivot_row][col];
+                result.m[row][col] -= factor * result.m[pivot_row][col];
+            }
+        }
+    }
+    return result;
+}
+static mat4 ref_trs(struct transform transf)
+{
+    mat4 trs = mat4_scale(transf.scale);
+
+    if (transf.rot.x)
+        trs = ref_mult(mat4_rotx(transf.rot.x), trs);
+    if (transf.rot.y)
+        trs = ref_mult(mat4_roty(transf.rot.y), trs);
+    if (transf.rot.z)
+        trs = ref_mult(mat4_rotz(transf.rot.z), trs);
+    if (transf.trans.x || transf.trans.y || transf.trans.z)
+        trs = ref_mult(mat4_trans(transf.trans), trs);
+    return trs;
+}
+
+static struct transform transforms[BENCH_SAMPLES];
+static mat4             matrices[BENCH_SAMPLES];
+static mat4             batch_out[BENCH_SAMPLES];
+static float            batch_floats[9][BENCH_SAMPLES];
+static const struct transform_soa BATCH = {
+    batch_floats[0], batch_floats[1], batch_floats[2],
+    batch_floats[3], batch_floats[4], batch_floats[5],
+    batch_floats[6], batch_floats[7], batch_floats[8],
+};
+static volatile float   sink;
+
+static float rng_float(struct rng *rng, float lo, float hi)
+{
+    return lo + (hi - lo) * (rng_next(rng) / 4294967296.0f);
+}
+static float max_rel_error(const mat4 *a, const mat4 *b)
+{
+    float err = 0, diff;
+    int row, col;
+
+    for (row = 0; row < 4; row++) {
+        for (col = 0; col < 4; col++) {
+            diff = fabsf(a->m[row][col] - b->m[row][col]) / fmaxf(1, fabsf(b->m[row][col]));
+            if (diff > err)
+                err = diff;
+        }
+    }
+    return err;
+}
+
+static int bench_check()
+{
+    float err_mult = 0, err_invert = 0, err_affine = 0, err_trs = 0, err_batch = 0;
+    mat4  ref, got;
+    int   i, res = 0;
+
+    mat4_trs_batch(&BATCH, BENCH_SAMPLES, batch_out);
+
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        ref = ref_mult(matrices[i], matrices[(i + 1) % BENCH_SAMPLES]);
+        got = mat4_mult(matrices[i], matrices[(i + 1) % BENCH_SAMPLES]);
+        err_mult = fmaxf(err_mult, max_rel_error(&got, &ref));
+
+        ref = ref_invert(matrices[i]);
+        got = mat4_invert(matrices[i]);
+        err_invert = fmaxf(err_invert, max_rel_error(&got, &ref));
+        if (mat4_invert_affine(matrices + i, &got) != 0)
+            err_affine = INFINITY;
+        err_affine = fmaxf(err_affine, max_rel_error(&got, &ref));
+
+        ref = ref_trs(transforms[i]);
+        got = mat4_trs(transforms[i]);
+        err_trs = fmaxf(err_trs, max_rel_error(&got, &ref));
+        err_batch = fmaxf(err_batch, max_rel_error(batch_out + i, &ref));
+    }
+
+    printf("max relative error against scalar reference, tolerance %g\n", BENCH_TOLERANCE);
+    printf("  mult       %g\n  invert     %g\n  affine     %g\n  trs        %g\n  trs_batch  %g\n",
+            err_mult, err_invert, err_affine, err_trs, err_batch);
+    if (err_mult > BENCH_TOLERANCE || err_invert > BENCH_TOLERANCE || err_affine > BENCH_TOLERANCE
+            || err_trs > BENCH_TOLERANCE || err_batch > BENCH_TOLERANCE) {
+        printf("FAILED\n");
+        res = -1;
+    }
+    return res;
+}
+
+#define BENCH_LOOP(label, rounds, body) do { \
+        double start = get_monotonic_time(), elapsed; \
+        int r, i; \
+        for (r = 0; r < (rounds); r++) \
+            for (i = 0; i < BENCH_SAMPLES; i++) { body; } \
+        elapsed = get_monotonic_time() - start; \
+        printf("  %-22s %7.2f ns/op\n", label, elapsed * 1e9 / ((double)(rounds) * BENCH_SAMPLES)); \
+    } while (0)
+
+int main(int argc, char *argv[])
+{
+    struct rng  rng;
+    mat4        out;
+    int         rounds = argc > 1 ? atoi(argv[1]) : 2000;
+    int         i;
+
+    rng_seed(&rng, 0xC0FFEE, 1);
+    for (i = 0; i < BENCH_SAMPLES; i++) {
+        transforms[i].trans = vec3_create(rng_float(&rng, -50, 50), rng_float(&rng, -50, 50), rng_float(&rng, -50, 50));
+        transforms[i].rot   = vec3_create(rng_float(&rng, -PI, PI), rng_float(&rng, -PI, PI), rng_float(&rng, -PI, PI));
+        transforms[i].scale = vec3_create(rng_float(&rng, .1f, 3), rng_float(&rng, .1f, 3), rng_float(&rng, .1f, 3));
+        matrices[i]         = ref_trs(transforms[i]);
+
+        batch_floats[0][i] = transforms[i].trans.x; batch_floats[1][i] = transforms[i].trans.y; batch_floats[2][i] = transforms[i].trans.z;
+        batch_floats[3][i] = transforms[i].rot.x;   batch_floats[4][i] = transforms[i].rot.y;   batch_floats[5][i] = transforms[i].rot.z;
+        batch_floats[6][i] = transforms[i].scale.x; batch_floats[7][i] = transforms[i].scale.y; batch_floats[8][i] = transforms[i].scale.z;
+    }
+
+    printf("mat4 kernels: %s\n", mat4_simd_path());
+    if (bench_check() != 0)
+        return 1;
+
+    printf("%d x %d ops each\n", rounds, BENCH_SAMPLES);
+    BENCH_LOOP("mult (reference)",  rounds, out = ref_mult(matrices[i], matrices[(i + 1) % BENCH_SAMPLES]); sink = out.m[0][0]);
+    BENCH_LOOP("mult",              rounds, out = mat4_mult(matrices[i], matrices[(i + 1) % BENCH_SAMPLES]); sink = out.m[0][0]);
+    BENCH_LOOP("mult_ptr",          rounds, mat4_mult_ptr(matrices + i, matrices + (i + 1) % BENCH_SAMPLES, &out); sink = out.m[0][0]);
+    BENCH_LOOP("invert (reference)", rounds / 4, out = ref_invert(matrices[i]); sink = out.m[0][0]);
+    BENCH_LOOP("invert",            rounds / 4, out = mat4_invert(matrices[i]); sink = out.m[0][0]);
+    BENCH_LOOP("invert_affine",     rounds / 4, mat4_invert_affine(matrices + i, &out); sink = out.m[0][0]);
+    BENCH_LOOP("trs (reference)",   rounds / 4, out = ref_trs(transforms[i]); sink = out.m[0][0]);
+    BENCH_LOOP("trs",               rounds / 4, out = mat4_trs(transforms[i]); sink = out.m[0][0]);
+    BENCH_LOOP("trs_batch",         rounds / 4, if (!i) mat4_trs_batch(&BATCH, BENCH_SAMPLES, batch_out); sink = batch_out[i].m[0][0]);
+    return 0;
+}
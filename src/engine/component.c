@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include "engine/system/graphic.h"
@@ -6,80 +7,98 @@
 #include "engine/system/time.h"
 #include "engine/component.h"
 
-#ifndef NDEBUG
-#define HAS_0_SCALE(transf) (!(transf).data.scale.x || !(transf).data.scale.y || !(transf).data.scale.z)
-#else
-#define HAS_0_SCALE(transf) 0
-#endif
-
 struct component_pool {
-    short           sparse[ENTITY_MAX];
-    entity_t        dense[ENTITY_MAX];
-    size_t          len,
-                    allocated_len;
-    void           *data;
+    struct entity_slot_map  sparse;
+    entity_t               *dense;
+    size_t                  len,
+                            allocated_len;
+    unsigned int            layout_version;
+    void                   *data;
 };
 
 int component_pool_init(struct component_pool *pool, size_t initial_alloc_len, size_t elem_size)
 {
-    int i;
-
-    for (i = 0; i < ENTITY_MAX; i++)
-        pool->sparse[i] = -1;
-
+    memset(&pool->sparse, 0, sizeof(pool->sparse));
     pool->len = 0;
     pool->allocated_len = initial_alloc_len;
-    pool->data = malloc(initial_alloc_len * elem_size);
-    return pool->data != NULL;
+    pool->layout_version = 0;
+    pool->data  = malloc(initial_alloc_len * elem_size);
+    pool->dense = malloc(initial_alloc_len * sizeof(entity_t));
+    return pool->data != NULL && pool->dense != NULL;
 }
 
 void component_pool_deinit(struct component_pool *pool)
 {
+    entity_slot_map_deinit(&pool->sparse);
+    free(pool->dense);
     free(pool->data);
 }
 
 void *component_pool_emplace(struct component_pool *pool, entity_t entity, size_t elem_size)
 {
+    int        *slot;
+    void       *data, *dense;
+
     if (entity_is_invalid(entity)) {
         cuno_logf(LOG_WARN, "COMP: Entity is invalid. Cannot emplace.");
         return NULL;
     }
-    if (pool->sparse[entity] != -1) {
+    slot = entity_slot_map_at(&pool->sparse, entity_index(entity));
+    if (!slot) {
+        cuno_logf(LOG_ERR, "COMP: Failed to allocate sparse page for entity %d. Cannot emplace.", entity);
+        return NULL;
+    }
+    if (*slot != -1) {
         cuno_logf(LOG_WARN, "COMP: Component for entity %d already exists. Cannot emplace.", entity);
         return NULL;
     }
 
-    pool->sparse[entity] = pool->len;
-    pool->dense[pool->len] = entity;
-    pool->len++;
-
-    if (pool->len > pool->allocated_len) {
+    if (pool->len == pool->allocated_len) {
+        data  = realloc(pool->data, elem_size * pool->allocated_len * 2);
+        if (data)
+            pool->data = data;
+        dense = realloc(pool->dense, sizeof(entity_t) * pool->allocated_len * 2);
+        if (dense)
+            pool->dense = dense;
+        if (!data || !dense) {
+            cuno_logf(LOG_ERR, "COMP: Failed to grow pool past %zu. Cannot emplace.", pool->len);
+            return NULL;
+        }
         pool->allocated_len *= 2;
-        pool->data = realloc(pool->data, elem_size * pool->allocated_len);
     }
+
+    *slot = pool->len;
+    pool->dense[pool->len] = entity;
+    pool->len++;
+    pool->layout_version++;
     return (char *)pool->data + (pool->len - 1)*elem_size;
 }
 
 int component_pool_erase(struct component_pool *pool, entity_t entity, size_t elem_size)
 {
-    entity_t last_entity;
+    entity_t    last_entity;
+    int        *slot, slot_idx;
 
     if (entity_is_invalid(entity)) {
         cuno_logf(LOG_WARN, "COMP: Entity invalid. Cannot erase.");
         return -1;
     }
-    if (pool->sparse[entity] == -1) {
+    /* A stale handle's index may already belong to another entity's component */
+    slot_idx = entity_slot_map_get(&pool->sparse, entity_index(entity));
+    if (slot_idx == -1 || pool->dense[slot_idx] != entity) {
         cuno_logf(LOG_WARN, "COMP: Component for this entity doesn't exist. Cannot erase.");
         return -2;
     }
 
+    slot = entity_slot_map_at(&pool->sparse, entity_index(entity));
     last_entity = pool->dense[--pool->len];
-    pool->sparse[last_entity] = pool->sparse[entity];
-    pool->dense[pool->sparse[entity]] = last_entity;
-    memcpy((char *)pool->data + pool->sparse[entity] * elem_size, 
+    *entity_slot_map_at(&pool->sparse, entity_index(last_entity)) = *slot;
+    pool->dense[*slot] = last_entity;
+    memcpy((char *)pool->data + *slot * elem_size,
            (char *)pool->data + pool->len * elem_size,
            elem_size);
-    pool->sparse[entity] = -1;
+    *slot = -1;
+    pool->layout_version++;
     return 0;
 }
 
@@ -105,29 +124,117 @@ int component_pool_erase(struct component_pool *pool, entity_t entity, size_t el
 
 struct comp_system_family {
     struct comp_system              base;
-    entity_t                        parent_map[ENTITY_MAX];
-    entity_t                        first_child_map[ENTITY_MAX];
-    entity_t                        sibling_map[ENTITY_MAX];
+    struct entity_link_map          parent_map;
+    struct entity_link_map          first_child_map;
+    struct entity_link_map          sibling_map;
+
+    struct comp_system_transform   *sys_transf;
 };
+/* The transform pool is kept in topological order, a transform's parent
+ * always sits in an earlier slot so syncing is a single forward pass */
 DEFINE_COMPONENT_POOL(static, struct comp_transform, comp_pool_transform)
+DEFINE_ARRAY_LIST_WRAPPER(static, int, comp_slot_list)
+/* Desynced entities wait in dirty until the next sync, which only walks them
+ * and their subtrees. sync_all skips the queue for a full forward pass */
 struct comp_system_transform {
     struct comp_system              base;
     struct comp_pool_transform      pool;
+    struct entity_list              dirty;
+    struct comp_slot_list           dirty_slots;
+    char                            sync_all;
+    unsigned int                    sync_count;     /* Bumped by every sync that rebuilt matrices */
+
+    /* Scratch for mat4_trs_batch, the soa arrays all point into batch_floats */
+    struct transform_soa            batch;
+    float                          *batch_floats;
+    mat4                           *batch_matrices;
+    size_t                          batch_allocated_len;
 
     struct comp_system_family      *sys_family;
 };
+/* Transform slot of every element in a pool that's iterated together with
+ * transforms, -1 where the entity has none. Rebuilt only after either pool's
+ * layout changed, so hot loops index transforms directly instead of going
+ * through the sparse pages and the dense check per entity */
+struct comp_transform_join {
+    int                            *slots;
+    size_t                          allocated_len;
+    unsigned int                    layout_version,
+                                    transf_layout_version;
+    char                            built;
+};
 DEFINE_COMPONENT_POOL(static, struct comp_visual, comp_pool_visual)
+/* Every visible visual is queued once per frame under a key that orders
+ * projection, pass, then texture and depth, see render_key */
+struct render_item {
+    uint64_t                        key;
+    int                             slot;
+};
+DEFINE_ARRAY_LIST_WRAPPER(static, struct render_item, render_queue)
 struct comp_system_visual {
     struct comp_system              base;
     struct comp_pool_visual         pool_ortho;
     struct comp_pool_visual         pool_persp;
+    struct comp_transform_join      join_ortho;
+    struct comp_transform_join      join_persp;
+    struct render_queue             queue;
+    struct render_queue             queue_scratch;
+
+    /* Bumped when the projection changes, or when the transform pool's
+     * layout does since a re-emplaced transform restarts its matrix_version */
+    mat4                            last_persp,
+                                    last_ortho;
+    unsigned int                    persp_version,
+                                    ortho_version,
+                                    transf_layout_version;
 
     struct comp_system_transform   *sys_transf;
 };
 DEFINE_COMPONENT_POOL(static, struct comp_hitrect, comp_pool_hitrect)
+/* Broad phase for picking. Every hitrect is hashed into the cells its world
+ * bounds cover, camspace rects by their projection onto the z = -1 plane.
+ * Rects whose bounds can't be put on the grid sit in unbounded and are
+ * tested on every query */
+#define HITRECT_GRID_BUCKETS        256
+#define HITRECT_GRID_MAX_SPAN       16
+#define HITRECT_GRID_CELL_ORTHO     64.0f
+#define HITRECT_GRID_CELL_CAMSPACE  0.125f
+#define HITRECT_GRID_CELL_LIMIT     16384
+enum hitrect_index_state {
+    HITRECT_UNINDEXED,
+    HITRECT_INDEXED_CELLS,
+    HITRECT_INDEXED_UNBOUNDED,
+};
+struct hitrect_grid {
+    float                           cell_size;
+    struct entity_list              buckets[HITRECT_GRID_BUCKETS];
+    struct entity_list              unbounded;
+};
+/* comp_hitrect.pointer flags */
+#define HITRECT_POINTER_OVER        (1<<0)
+#define HITRECT_POINTER_SEEN        (1<<1)
+#define HITRECT_POINTER_FIRED       (1<<2)
+#define HITRECT_POINTER_SIGNALLED   (1<<3)
+/* Rects under the pointer are kept in hovered between events and only
+ * retested once the pointer moved or the index changed, handlers fire on
+ * the transitions that came out of it */
 struct comp_system_hitrect {
     struct comp_system              base;
     struct comp_pool_hitrect        pool;
+    struct comp_transform_join      join;
+
+    struct hitrect_grid             grids[2];   /* By enum hitrect_type */
+    unsigned int                    indexed_sync_count;
+    char                            index_stale;
+
+    struct entity_list              hovered;
+    struct entity_list              hits;
+    struct entity_list              fired;
+    struct entity_list              signalled;
+    vec2                            pointer_ortho;
+    vec3                            pointer_ray;
+    char                            pointer_valid;
+    char                            pointer_held;
 
     struct comp_system_transform   *sys_transf;
 };
@@ -135,33 +242,41 @@ DEFINE_COMPONENT_POOL(static, struct comp_interpolator, comp_pool_interpolator)
 struct comp_system_interpolator {
     struct comp_system              base;
     struct comp_pool_interpolator   pool;
+    struct comp_transform_join      join;
 
     struct comp_system_transform   *sys_transf;
 };
 
+static void comp_system_transform_on_reparent(struct comp_system_transform *sys, entity_t entity);
+
 /* FAMILY */
+static entity_t family_link_get(const struct entity_link_map *map, entity_t entity)
+{
+    return entity_link_map_get(map, entity_index(entity));
+}
+static int family_link_set(struct entity_link_map *map, entity_t entity, entity_t link)
+{
+    entity_t *slot = entity_link_map_at(map, entity_index(entity));
+    if (!slot)
+        return -1;
+    *slot = link;
+    return 0;
+}
 struct comp_system_family *comp_system_family_create(struct comp_system base)
 {
-    int i;
-    struct comp_system_family *sys = malloc(sizeof(struct comp_system_family));
+    struct comp_system_family *sys = calloc(1, sizeof(struct comp_system_family));
     if (!sys)
         return NULL;
 
     sys->base = base;
-
-    for (i = 0; i < ENTITY_MAX; i++) {
-        sys->parent_map[i] = ENTITY_INVALID;
-        sys->first_child_map[i] = ENTITY_INVALID;
-        sys->sibling_map[i] = ENTITY_INVALID;
-    }
     return sys;
 }
 struct comp_system_family_view comp_system_family_view(struct comp_system_family *sys)
 {
     struct comp_system_family_view view = {
-        sys->parent_map,
-        sys->first_child_map,
-        sys->sibling_map
+        &sys->parent_map,
+        &sys->first_child_map,
+        &sys->sibling_map
     };
     return view;
 }
@@ -175,10 +290,10 @@ size_t comp_system_family_count_children(struct comp_system_family *sys, entity_
         return SIZE_MAX;
     }
 
-    current = sys->first_child_map[entity];
+    current = family_link_get(&sys->first_child_map, entity);
     while (!entity_is_invalid(current)) {
         count++;
-        current = sys->sibling_map[current];
+        current = family_link_get(&sys->sibling_map, current);
     }
 
     return count;
@@ -188,16 +303,16 @@ entity_t comp_system_family_find_previous_sibling(struct comp_system_family *sys
     entity_t current,
              last = ENTITY_INVALID;
 
-    if (entity_is_invalid(sys->parent_map[entity]))
+    if (entity_is_invalid(family_link_get(&sys->parent_map, entity)))
         return -1;
-    current = sys->first_child_map[ sys->parent_map[entity] ];
+    current = family_link_get(&sys->first_child_map, family_link_get(&sys->parent_map, entity));
 
     while (!entity_is_invalid(current)) {
         if (current == entity)
             break;
 
         last = current;
-        current = sys->sibling_map[current];
+        current = family_link_get(&sys->sibling_map, current);
     }
     return last;
 }
@@ -208,40 +323,55 @@ entity_t comp_system_family_find_last_child(struct comp_system_family *sys, enti
     if (entity_is_invalid(parent))
         return ENTITY_INVALID;
 
-    current = sys->first_child_map[parent];
+    current = family_link_get(&sys->first_child_map, parent);
     if (entity_is_invalid(current))
         return ENTITY_INVALID;
 
-    while (!entity_is_invalid(sys->sibling_map[current])) {
-        current = sys->sibling_map[current];
+    while (!entity_is_invalid(family_link_get(&sys->sibling_map, current))) {
+        current = family_link_get(&sys->sibling_map, current);
     }
     return current;
 }
 void comp_system_family_adopt(struct comp_system_family *sys, entity_t parent, entity_t entity)
 {
-    sys->parent_map[entity] = parent;
-    if (entity_is_invalid(sys->first_child_map[parent]))
-        sys->first_child_map[parent] = entity;
+    /* Touch every page first so a failed allocation leaves the links untouched */
+    if (!entity_link_map_at(&sys->parent_map, entity_index(entity))
+            || !entity_link_map_at(&sys->sibling_map, entity_index(entity))
+            || !entity_link_map_at(&sys->first_child_map, entity_index(parent))) {
+        cuno_logf(LOG_ERR, "COMPSYS_FAM: Failed to allocate link pages. Cannot adopt entity %d.", entity);
+        return;
+    }
+
+    family_link_set(&sys->parent_map, entity, parent);
+    if (entity_is_invalid(family_link_get(&sys->first_child_map, parent)))
+        family_link_set(&sys->first_child_map, parent, entity);
     else
-        sys->sibling_map[comp_system_family_find_last_child(sys, parent)] = entity;
+        family_link_set(&sys->sibling_map, comp_system_family_find_last_child(sys, parent), entity);
 
+    if (sys->sys_transf)
+        comp_system_transform_on_reparent(sys->sys_transf, entity);
     entity_record_flag_component(sys->base.entity_record, entity, sys->base.component_flag);
 }
 int comp_system_family_disown(struct comp_system_family *sys, entity_t entity)
 {
     entity_t prev; 
 
-    if (entity_is_invalid(sys->parent_map[entity]))
+    if (!entity_record_is_alive(sys->base.entity_record, entity))
+        return -1;
+    if (entity_is_invalid(family_link_get(&sys->parent_map, entity)))
         return -1;
 
     prev = comp_system_family_find_previous_sibling(sys, entity);
     if (entity_is_invalid(prev))
-        sys->first_child_map[ sys->parent_map[entity] ] = sys->sibling_map[entity];
+        family_link_set(&sys->first_child_map, family_link_get(&sys->parent_map, entity), family_link_get(&sys->sibling_map, entity));
     else 
-        sys->sibling_map[prev] = sys->sibling_map[entity];
+        family_link_set(&sys->sibling_map, prev, family_link_get(&sys->sibling_map, entity));
+
+    family_link_set(&sys->parent_map, entity, ENTITY_INVALID);
+    family_link_set(&sys->sibling_map, entity, ENTITY_INVALID);
 
-    sys->parent_map[entity]  = ENTITY_INVALID;
-    sys->sibling_map[entity] = ENTITY_INVALID;
+    if (sys->sys_transf)
+        comp_system_transform_on_reparent(sys->sys_transf, entity);
 
     entity_record_unflag_component(sys->base.entity_record, entity, sys->base.component_flag);
     return 0;
@@ -249,6 +379,34 @@ int comp_system_family_disown(struct comp_system_family *sys, entity_t entity)
 
 
 /* TRANSFORM */
+static int comp_transform_join_update(struct comp_transform_join *join, const entity_t *dense, size_t len,
+                                      unsigned int layout_version, const struct comp_pool_transform *pool_transf)
+{
+    int    *slots, slot;
+    size_t  i;
+
+    if (join->built && join->layout_version == layout_version && join->transf_layout_version == pool_transf->layout_version)
+        return 0;
+
+    if (len > join->allocated_len) {
+        slots = realloc(join->slots, len * sizeof(int));
+        if (!slots) {
+            cuno_logf(LOG_ERR, "COMP_TRANSF: Failed to grow transform join to %zu", len);
+            return -1;
+        }
+        join->slots         = slots;
+        join->allocated_len = len;
+    }
+    for (i = 0; i < len; i++) {
+        slot = entity_slot_map_get(&pool_transf->sparse, entity_index(dense[i]));
+        join->slots[i] = (slot != -1 && pool_transf->dense[slot] == dense[i]) ? slot : -1;
+    }
+
+    join->layout_version        = layout_version;
+    join->transf_layout_version = pool_transf->layout_version;
+    join->built                 = 1;
+    return 0;
+}
 void comp_transform_set_default(struct comp_transform *transf)
 {
     transf->data.trans      = VEC3_ZERO;
@@ -268,102 +426,317 @@ struct comp_system_transform *comp_system_transform_create(struct comp_system ba
     
     sys->base = base;
     sys->sys_family = sys_fam;
+    sys_fam->sys_transf = sys;
+    sys->sync_all = 0;
+    sys->sync_count = 0;
+    sys->batch_floats = NULL;
+    sys->batch_matrices = NULL;
+    sys->batch_allocated_len = 0;
     comp_pool_transform_init(&sys->pool, COMP_POOL_INITIAL_ALLOC);
+    entity_list_init(&sys->dirty, COMP_POOL_INITIAL_ALLOC);
+    comp_slot_list_init(&sys->dirty_slots, COMP_POOL_INITIAL_ALLOC);
 
     return sys;
 }
-DEFINE_POOL_BASED_EMPLACE_ERASE_GET(transform);
+static int comp_system_transform_slot(const struct comp_system_transform *sys, entity_t entity)
+{
+    int slot;
+
+    if (entity_is_invalid(entity))
+        return -1;
+    slot = entity_slot_map_get(&sys->pool.sparse, entity_index(entity));
+    return (slot != -1 && sys->pool.dense[slot] == entity) ? slot : -1;
+}
+/* Depth first walk over the descendants of root through the family links,
+ * returns ENTITY_INVALID once the whole subtree was visited */
+static entity_t family_next_in_subtree(const struct comp_system_family *sys, entity_t root, entity_t current)
+{
+    entity_t next = family_link_get(&sys->first_child_map, current);
+
+    if (!entity_is_invalid(next))
+        return next;
+    while (current != root) {
+        next = family_link_get(&sys->sibling_map, current);
+        if (!entity_is_invalid(next))
+            return next;
+        current = family_link_get(&sys->parent_map, current);
+    }
+    return ENTITY_INVALID;
+}
+static int comp_system_transform_is_out_of_order(struct comp_system_transform *sys, entity_t entity)
+{
+    const int   SLOT = comp_system_transform_slot(sys, entity);
+    entity_t    child;
+
+    if (SLOT == -1)
+        return 0;
+    if (comp_system_transform_slot(sys, family_link_get(&sys->sys_family->parent_map, entity)) > SLOT)
+        return 1;
+
+    child = family_link_get(&sys->sys_family->first_child_map, entity);
+    for (; !entity_is_invalid(child); child = family_link_get(&sys->sys_family->sibling_map, child))
+        if (comp_system_transform_slot(sys, child) != -1 && comp_system_transform_slot(sys, child) < SLOT)
+            return 1;
+    return 0;
+}
+/* Shifts everything after slot down by one and puts slot's transform last,
+ * keeping the relative order of the rest */
+static void comp_system_transform_move_back(struct comp_system_transform *sys, int slot)
+{
+    const size_t            LAST = sys->pool.len - 1;
+    struct comp_transform   moved_data = sys->pool.data[slot];
+    entity_t                moved_entity = sys->pool.dense[slot];
+    size_t                  i;
+
+    memmove(sys->pool.data + slot, sys->pool.data + slot + 1, (LAST - slot) * sizeof(struct comp_transform));
+    memmove(sys->pool.dense + slot, sys->pool.dense + slot + 1, (LAST - slot) * sizeof(entity_t));
+    sys->pool.data[LAST]  = moved_data;
+    sys->pool.dense[LAST] = moved_entity;
+
+    for (i = slot; i <= LAST; i++)
+        *entity_slot_map_at(&sys->pool.sparse, entity_index(sys->pool.dense[i])) = i;
+    sys->pool.layout_version++;
+}
+/* Called whenever entity's place in the pool or the hierarchy changed. If it ended
+ * up before its parent or after one of its children, it and its descendants are
+ * moved to the back in depth first order, which satisfies both. Reordering
+ * invalidates comp_transform pointers like a pool reallocation does */
+static void comp_system_transform_restore_order(struct comp_system_transform *sys, entity_t entity)
+{
+    entity_t current;
+    int      slot;
+
+    if (!comp_system_transform_is_out_of_order(sys, entity))
+        return;
+
+    for (current = entity; !entity_is_invalid(current); current = family_next_in_subtree(sys->sys_family, entity, current)) {
+        slot = comp_system_transform_slot(sys, current);
+        if (slot != -1)
+            comp_system_transform_move_back(sys, slot);
+    }
+}
+struct comp_transform *comp_system_transform_emplace(struct comp_system_transform *sys, entity_t entity)
+{
+    struct comp_transform *transf = comp_pool_transform_emplace(&sys->pool, entity);
+    if (!transf)
+        return NULL;
+
+    transf->synced = 0;
+    transf->queued = 1;
+    *entity_list_emplace(&sys->dirty, 1) = entity;
+
+    entity_record_flag_component(sys->base.entity_record, entity, sys->base.component_flag);
+    comp_system_transform_restore_order(sys, entity);
+    return comp_pool_transform_try_get(&sys->pool, entity);
+}
+void comp_system_transform_erase(struct comp_system_transform *sys, entity_t entity)
+{
+    const int SLOT = comp_system_transform_slot(sys, entity);
+    entity_t  child;
+
+    if (comp_pool_transform_erase(&sys->pool, entity) != 0)
+        return;
+    entity_record_unflag_component(sys->base.entity_record, entity, sys->base.component_flag);
+
+    /* Children lose the parent matrix they were built on */
+    child = family_link_get(&sys->sys_family->first_child_map, entity);
+    for (; !entity_is_invalid(child); child = family_link_get(&sys->sys_family->sibling_map, child))
+        if (comp_system_transform_slot(sys, child) != -1)
+            comp_system_transform_desync(sys, child);
+
+    /* The last transform was swapped into the freed slot */
+    if (SLOT < sys->pool.len)
+        comp_system_transform_restore_order(sys, sys->pool.dense[SLOT]);
+}
+struct comp_transform *comp_system_transform_get(struct comp_system_transform *sys, entity_t entity)
+{
+    return comp_pool_transform_try_get(&sys->pool, entity);
+}
 void comp_system_transform_desync(struct comp_system_transform *sys, entity_t entity)
 {
-    entity_t               child;
     struct comp_transform *transf;
 
     if (entity_is_invalid(entity)) {
         cuno_logf(LOG_WARN, "COMP_TRANSF: Entity invalid. Cannot update changes.");
         return;
     }
-
     transf = comp_pool_transform_try_get(&sys->pool, entity);
     if (!transf) {
         cuno_logf(LOG_WARN, "COMP_TRANSF: Entity does not have transform. Cannot update changes.");
         return;
     }
 
-    transf->synced = 0;
-
-    child = sys->sys_family->first_child_map[entity];
-    if (entity_is_invalid(entity))
+    if (transf->queued)
         return;
-     
-    while (!entity_is_invalid(child)) {
-        transf = comp_pool_transform_try_get(&sys->pool, child);
-        if (transf)
-            transf->synced = 0;
-
-        if (!entity_is_invalid(sys->sys_family->first_child_map[child]))
-            comp_system_transform_desync(sys, child);
-
-        child = sys->sys_family->sibling_map[child];
-    }
+    transf->queued = 1;
+    *entity_list_emplace(&sys->dirty, 1) = entity;
+}
+/* A new parent changes the world matrix even when data didn't */
+static void comp_system_transform_on_reparent(struct comp_system_transform *sys, entity_t entity)
+{
+    if (comp_system_transform_slot(sys, entity) == -1)
+        return;
+    comp_system_transform_restore_order(sys, entity);
+    comp_system_transform_desync(sys, entity);
 }
 
 void comp_system_transform_desync_everything(struct comp_system_transform *sys)
 {
-    int i;
-    
-    for (i = 0; i < sys->pool.len; i++)
-        sys->pool.data[i].synced = 0;
+    sys->sync_all = 1;
 }
 
-static void comp_system_transform_sync_matrix(struct comp_system_transform *sys, size_t data_index)
+static int comp_system_transform_batch_reserve(struct comp_system_transform *sys, size_t len)
 {
-    struct comp_transform *transf, *parent_transf;
+    size_t  new_len = sys->batch_allocated_len ? sys->batch_allocated_len : COMP_POOL_INITIAL_ALLOC;
+    float  *floats;
+    mat4   *matrices;
 
-    transf = sys->pool.data + data_index;
-
-    if (transf->synced)
-        return;
+    if (len <= sys->batch_allocated_len)
+        return 0;
+    while (new_len < len)
+        new_len *= 2;
+
+    floats = realloc(sys->batch_floats, new_len * 9 * sizeof(float));
+    if (floats)
+        sys->batch_floats = floats;
+    matrices = realloc(sys->batch_matrices, new_len * sizeof(mat4));
+    if (matrices)
+        sys->batch_matrices = matrices;
+    if (!floats || !matrices) {
+        cuno_logf(LOG_ERR, "COMP_TRANSF: Failed to grow the sync batch to %zu", len);
+        return -1;
+    }
 
-    transf->matrix = mat4_trs(transf->data);
+    sys->batch.trans_x = floats;
+    sys->batch.trans_y = floats + new_len;
+    sys->batch.trans_z = floats + new_len*2;
+    sys->batch.rot_x   = floats + new_len*3;
+    sys->batch.rot_y   = floats + new_len*4;
+    sys->batch.rot_z   = floats + new_len*5;
+    sys->batch.scale_x = floats + new_len*6;
+    sys->batch.scale_y = floats + new_len*7;
+    sys->batch.scale_z = floats + new_len*8;
+    sys->batch_allocated_len = new_len;
+    return 0;
+}
+/* Local matrices of every slot are built in one batch, then applied to their
+ * parents in slot order. slots must be ascending so parents are synced first */
+static void comp_system_transform_sync_slots(struct comp_system_transform *sys, const int *slots, size_t len)
+{
+    const struct transform *data;
+    struct comp_transform  *transf;
+    size_t                  i;
+    int                     parent_slot;
 
-    parent_transf = comp_pool_transform_try_get(&sys->pool, sys->sys_family->parent_map[sys->pool.dense[data_index]]);
-    if (parent_transf) {
-        comp_system_transform_sync_matrix(sys, (parent_transf - sys->pool.data));
-        transf->matrix = mat4_mult(parent_transf->matrix, transf->matrix);
+    if (comp_system_transform_batch_reserve(sys, len) != 0)
+        return;
+    if (len)
+        sys->sync_count++;
+
+    for (i = 0; i < len; i++) {
+        data = &sys->pool.data[slots[i]].data;
+        sys->batch.trans_x[i] = data->trans.x;
+        sys->batch.trans_y[i] = data->trans.y;
+        sys->batch.trans_z[i] = data->trans.z;
+        sys->batch.rot_x[i]   = data->rot.x;
+        sys->batch.rot_y[i]   = data->rot.y;
+        sys->batch.rot_z[i]   = data->rot.z;
+        sys->batch.scale_x[i] = data->scale.x;
+        sys->batch.scale_y[i] = data->scale.y;
+        sys->batch.scale_z[i] = data->scale.z;
     }
-
-    transf->matrix_version++;
-    transf->synced = 1;
+    mat4_trs_batch(&sys->batch, len, sys->batch_matrices);
+
+    for (i = 0; i < len; i++) {
+        transf = sys->pool.data + slots[i];
+        parent_slot = comp_system_transform_slot(sys, family_link_get(&sys->sys_family->parent_map, sys->pool.dense[slots[i]]));
+        if (parent_slot != -1)
+            mat4_mult_ptr(&sys->pool.data[parent_slot].matrix, sys->batch_matrices + i, &transf->matrix);
+        else
+            transf->matrix = sys->batch_matrices[i];
+
+        transf->matrix_version++;
+        transf->synced = 1;
+    }
+}
+static int slot_compare(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
 }
+/* Every queued transform and the transforms below it are gathered by slot,
+ * since the pool is in topological order sorting the slots puts each parent
+ * ahead of its children. Overlapping subtrees show up as duplicates */
 void comp_system_transform_sync_matrices(struct comp_system_transform *sys)
 {
-    int i;
-    struct comp_transform *transf, *parent_transf;
+    struct comp_transform  *transf;
+    entity_t                root, current;
+    size_t                  i, unique_len;
+    int                     slot;
 
-    for (i = 0; i < sys->pool.len; i++)
-        comp_system_transform_sync_matrix(sys, i);
+    if (!sys->sync_all && !sys->dirty.len)
+        return;
+
+    comp_slot_list_clear(&sys->dirty_slots);
+    for (i = 0; i < sys->dirty.len; i++) {
+        root = sys->dirty.elems[i];
+        if (!(transf = comp_pool_transform_try_get(&sys->pool, root)))
+            continue;
+        transf->queued = 0;
+        if (sys->sync_all)
+            continue;
+
+        for (current = root; !entity_is_invalid(current); current = family_next_in_subtree(sys->sys_family, root, current)) {
+            slot = comp_system_transform_slot(sys, current);
+            if (slot == -1)
+                continue;
+            sys->pool.data[slot].synced = 0;
+            *comp_slot_list_emplace(&sys->dirty_slots, 1) = slot;
+        }
+    }
+    entity_list_clear(&sys->dirty);
+
+    if (sys->sync_all) {
+        for (i = 0; i < sys->pool.len; i++)
+            *comp_slot_list_emplace(&sys->dirty_slots, 1) = i;
+        sys->sync_all = 0;
+    } else {
+        qsort(sys->dirty_slots.elems, sys->dirty_slots.len, sizeof(int), slot_compare);
+        for (i = 0, unique_len = 0; i < sys->dirty_slots.len; i++)
+            if (!unique_len || sys->dirty_slots.elems[unique_len - 1] != sys->dirty_slots.elems[i])
+                sys->dirty_slots.elems[unique_len++] = sys->dirty_slots.elems[i];
+        sys->dirty_slots.len = unique_len;
+    }
+
+    comp_system_transform_sync_slots(sys, sys->dirty_slots.elems, sys->dirty_slots.len);
 }
 struct transform comp_system_transform_get_world(struct comp_system_transform *sys, entity_t entity)
 {
-    struct comp_transform  *transf = comp_system_transform_get(sys, entity);
+    struct comp_transform  *transf;
 
-    comp_system_transform_sync_matrix(sys, sys->pool.sparse[entity]);
+    comp_system_transform_sync_matrices(sys);
+    transf = comp_system_transform_get(sys, entity);
     return transform_from_mat4(transf->matrix);
 }
 struct transform comp_system_transform_get_relative(struct comp_system_transform *sys, entity_t parent, entity_t subject)
 {
-    struct comp_transform *transf_parent = comp_system_transform_get(sys, parent),
-                          *transf_subject = comp_system_transform_get(sys, subject);
+    struct comp_transform *transf_parent, *transf_subject;
+    mat4                   parent_inv = MAT4_IDENTITY;
+
+    comp_system_transform_sync_matrices(sys);
+    transf_parent  = comp_system_transform_get(sys, parent);
+    transf_subject = comp_system_transform_get(sys, subject);
 
-    comp_system_transform_sync_matrix(sys, sys->pool.sparse[parent]);
-    comp_system_transform_sync_matrix(sys, sys->pool.sparse[subject]);
-    return transform_from_mat4( mat4_mult(mat4_invert(transf_parent->matrix), transf_subject->matrix) );
+    if (mat4_invert_affine(&transf_parent->matrix, &parent_inv) != 0)
+        cuno_logf(LOG_WARN, "COMP_TRANSF: Entity %d matrix is non-invertible due to a zero scale", parent);
+    return transform_from_mat4( mat4_mult(parent_inv, transf_subject->matrix) );
 }
 
 
 /* VISUAL */
 void comp_visual_set_default(struct comp_visual *visual)
 {
+    visual->cached_proj_version = 0;
+
     visual->vertecies       = NULL;
     visual->texture         = NULL;
     visual->color           = VEC3_ZERO;
@@ -379,63 +752,215 @@ struct comp_system_visual *comp_system_visual_create(struct comp_system base, st
     sys->sys_transf = sys_transf;
     comp_pool_visual_init(&sys->pool_ortho, COMP_POOL_INITIAL_ALLOC/2);
     comp_pool_visual_init(&sys->pool_persp, COMP_POOL_INITIAL_ALLOC/2);
+    memset(&sys->join_ortho, 0, sizeof(struct comp_transform_join));
+    memset(&sys->join_persp, 0, sizeof(struct comp_transform_join));
+    render_queue_init(&sys->queue, COMP_POOL_INITIAL_ALLOC);
+    render_queue_init(&sys->queue_scratch, COMP_POOL_INITIAL_ALLOC);
+    sys->persp_version = 1;
+    sys->ortho_version = 1;
+    sys->transf_layout_version = sys_transf->pool.layout_version;
     return sys;
 }
 struct comp_visual *comp_system_visual_emplace(struct comp_system_visual *sys, entity_t entity, enum projection_type proj)
 {
     struct comp_visual *vis = comp_pool_visual_emplace((proj == PROJ_ORTHO ? &sys->pool_ortho : &sys->pool_persp), entity);
-    if (vis)
-        entity_record_flag_component(sys->base.entity_record, entity, sys->base.component_flag);
+    if (!vis)
+        return NULL;
+
+    vis->cached_proj_version = 0;
+    entity_record_flag_component(sys->base.entity_record, entity, sys->base.component_flag);
     return vis;
 }
 void comp_system_visual_erase(struct comp_system_visual *sys, entity_t entity)
 {
-    char is_ortho = sys->pool_ortho.sparse[entity] != -1;
+    char is_ortho = entity_slot_map_get(&sys->pool_ortho.sparse, entity_index(entity)) != -1;
     if (comp_pool_visual_erase(is_ortho ? &sys->pool_ortho : &sys->pool_persp, entity) == 0)
         entity_record_unflag_component(sys->base.entity_record, entity, sys->base.component_flag);
 }
 struct comp_visual *comp_system_visual_get(struct comp_system_visual *sys, entity_t entity)
 {
-    char is_ortho = sys->pool_ortho.sparse[entity] != -1;
+    char is_ortho = entity_slot_map_get(&sys->pool_ortho.sparse, entity_index(entity)) != -1;
     return comp_pool_visual_try_get(is_ortho ? &sys->pool_ortho : &sys->pool_persp, entity);
 }
-static void comp_visual_transform_pool_draw(struct comp_pool_visual *pool, struct comp_pool_transform *pool_transf, const mat4 *projection)
+/* Keys, from the top bit down:
+ *   projection  1   persp before ortho, the ortho layer goes over the scene
+ *   pass        4
+ *   opaque      material 8, view depth 24 near to far for early z
+ *   transparent view depth 24 far to near so blending layers right, material 8
+ * The low bits stay zero, radix sort is stable so ties keep pool order */
+#define RENDER_KEY_PROJ_SHIFT       63
+#define RENDER_KEY_PASS_SHIFT       59
+#define RENDER_KEY_PASS_MASK        0xF
+#define RENDER_KEY_HIGH_SHIFT       35
+#define RENDER_KEY_LOW_SHIFT        27
+#define RENDER_KEY_DEPTH_BITS       24
+#define RENDER_MATERIAL_MAX         256
+
+/* Float bits reordered so unsigned compare matches float compare */
+static uint32_t render_depth_bits(float depth)
 {
-    struct comp_visual    *visual;
-    struct comp_transform *transf;
-    enum draw_pass_type    pass = 0,
-                           final_pass = 1;
-    int i;
+    uint32_t bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    bits = (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+    return bits >> (32 - RENDER_KEY_DEPTH_BITS);
+}
+static uint64_t render_key(char is_ortho, enum draw_pass_type pass, unsigned int material, float depth)
+{
+    uint64_t key   = (uint64_t)is_ortho << RENDER_KEY_PROJ_SHIFT
+                   | (uint64_t)(pass & RENDER_KEY_PASS_MASK) << RENDER_KEY_PASS_SHIFT;
+    uint64_t depth_bits = render_depth_bits(depth);
 
-    for(; pass <= final_pass; pass++) {
-        for (i = 0; i < pool->len; i++) {
-            visual = pool->data + i;
-            if (visual->draw_pass > pass) {
-                final_pass = visual->draw_pass;
-                continue;
-            }
-            if (visual->draw_pass != pass)
-                continue;
+    if (pass == DRAW_PASS_OPAQUE)
+        return key | (uint64_t)material << (RENDER_KEY_LOW_SHIFT + RENDER_KEY_DEPTH_BITS)
+                   | depth_bits << RENDER_KEY_LOW_SHIFT;
+
+    depth_bits = ~depth_bits & ((1u << RENDER_KEY_DEPTH_BITS) - 1);
+    return key | depth_bits << RENDER_KEY_HIGH_SHIFT
+               | (uint64_t)material << RENDER_KEY_LOW_SHIFT;
+}
+/* LSD radix sort on bytes, bytes every key agrees on are skipped */
+static struct render_item *render_queue_sort(struct render_item *items, struct render_item *scratch, size_t len)
+{
+    struct render_item *swap;
+    uint64_t all_or = 0, all_and = ~(uint64_t)0;
+    size_t   counts[256], sum, i;
+    int      shift, digit;
+
+    for (i = 0; i < len; i++) {
+        all_or  |= items[i].key;
+        all_and &= items[i].key;
+    }
+
+    for (shift = 0; shift < 64; shift += 8) {
+        if ((((all_or ^ all_and) >> shift) & 0xFF) == 0)
+            continue;
 
-            transf = comp_pool_transform_try_get(pool_transf, pool->dense[i]);
-            graphic_draw(visual->vertecies, 
-                         visual->texture, 
-                         mat4_mult(*projection, transf ? transf->matrix : MAT4_IDENTITY),
-                         visual->color);
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < len; i++)
+            counts[(items[i].key >> shift) & 0xFF]++;
+        for (digit = 0, sum = 0; digit < 256; digit++) {
+            i = counts[digit];
+            counts[digit] = sum;
+            sum += i;
         }
+        for (i = 0; i < len; i++)
+            scratch[counts[(items[i].key >> shift) & 0xFF]++] = items[i];
+
+        swap    = items;
+        items   = scratch;
+        scratch = swap;
+    }
+    return items;
+}
+static void comp_visual_pool_enqueue(struct comp_system_visual *sys, struct comp_pool_visual *pool, const int *transf_slots,
+                                     char is_ortho, struct graphic_texture **materials, int *materials_len)
+{
+    struct comp_visual *visual;
+    struct render_item *item;
+    float               depth;
+    int                 i, material;
+
+    for (i = 0; i < pool->len; i++) {
+        visual = pool->data + i;
+        if (visual->draw_pass < 0 || !visual->vertecies)
+            continue;
+
+        for (material = 0; material < *materials_len; material++)
+            if (materials[material] == visual->texture)
+                break;
+        if (material == *materials_len && *materials_len < RENDER_MATERIAL_MAX)
+            materials[(*materials_len)++] = visual->texture;
+        material = min(material, RENDER_MATERIAL_MAX - 1);
+
+        /* Distance along the view direction, both projections look down -z */
+        depth = transf_slots[i] != -1 ? -sys->sys_transf->pool.data[transf_slots[i]].matrix.m[2][3] : 0;
+
+        item        = render_queue_emplace(&sys->queue, 1);
+        item->key   = render_key(is_ortho, visual->draw_pass, material, depth);
+        item->slot  = i;
     }
 }
+static unsigned int comp_system_visual_proj_version(struct comp_system_visual *sys, const mat4 *proj, char is_ortho)
+{
+    mat4         *last    = is_ortho ? &sys->last_ortho : &sys->last_persp;
+    unsigned int *version = is_ortho ? &sys->ortho_version : &sys->persp_version;
+
+    if (memcmp(last, proj, sizeof(mat4)) != 0 || sys->transf_layout_version != sys->sys_transf->pool.layout_version) {
+        *last = *proj;
+        /* 0 is what set_default leaves, it never matches */
+        if (++*version == 0)
+            *version = 1;
+    }
+    return *version;
+}
 void comp_system_visual_draw(struct comp_system_visual *sys, const mat4 *persp, const mat4 *ortho)
 {
-    comp_visual_transform_pool_draw(&sys->pool_persp, &sys->sys_transf->pool, persp);
-    comp_visual_transform_pool_draw(&sys->pool_ortho, &sys->sys_transf->pool, ortho);
+    struct graphic_texture *materials[RENDER_MATERIAL_MAX];
+    struct graphic_texture *last_texture = NULL;
+    const struct render_item *items;
+    struct comp_pool_visual  *pool;
+    struct comp_visual       *visual;
+    struct comp_transform    *transf;
+    const int                *transf_slots;
+    int                       materials_len = 0;
+    int                       is_ortho;
+    uint64_t                  last_key = 0;
+    unsigned int              proj_versions[2];
+    size_t                    i;
+
+    if (comp_transform_join_update(&sys->join_persp, sys->pool_persp.dense, sys->pool_persp.len,
+                                   sys->pool_persp.layout_version, &sys->sys_transf->pool) != 0
+            || comp_transform_join_update(&sys->join_ortho, sys->pool_ortho.dense, sys->pool_ortho.len,
+                                          sys->pool_ortho.layout_version, &sys->sys_transf->pool) != 0)
+        return;
+
+    proj_versions[0] = comp_system_visual_proj_version(sys, persp, 0);
+    proj_versions[1] = comp_system_visual_proj_version(sys, ortho, 1);
+    sys->transf_layout_version = sys->sys_transf->pool.layout_version;
+
+    render_queue_clear(&sys->queue);
+    comp_visual_pool_enqueue(sys, &sys->pool_persp, sys->join_persp.slots, 0, materials, &materials_len);
+    comp_visual_pool_enqueue(sys, &sys->pool_ortho, sys->join_ortho.slots, 1, materials, &materials_len);
+
+    render_queue_clear(&sys->queue_scratch);
+    render_queue_emplace(&sys->queue_scratch, sys->queue.len);
+    items = render_queue_sort(sys->queue.elems, sys->queue_scratch.elems, sys->queue.len);
+
+    for (i = 0; i < sys->queue.len; i++) {
+        is_ortho     = items[i].key >> RENDER_KEY_PROJ_SHIFT;
+        pool         = is_ortho ? &sys->pool_ortho : &sys->pool_persp;
+        transf_slots = is_ortho ? sys->join_ortho.slots : sys->join_persp.slots;
+        visual       = pool->data + items[i].slot;
+
+        /* Passes layer over each other, and within a transparent pass so do
+         * textures since the batch groups by texture */
+        if (i && ((items[i].key ^ last_key) >> RENDER_KEY_PASS_SHIFT
+                  || (visual->draw_pass != DRAW_PASS_OPAQUE && visual->texture != last_texture)))
+            graphic_batch_flush();
+        last_key     = items[i].key;
+        last_texture = visual->texture;
+
+        transf = transf_slots[items[i].slot] != -1 ? sys->sys_transf->pool.data + transf_slots[items[i].slot] : NULL;
+        if (visual->cached_proj_version != proj_versions[is_ortho]
+                || (transf && visual->cached_version != transf->matrix_version)) {
+            mat4_mult_ptr(is_ortho ? ortho : persp, transf ? &transf->matrix : &MAT4_IDENTITY, &visual->cached_mvp);
+            visual->cached_proj_version = proj_versions[is_ortho];
+            visual->cached_version      = transf ? transf->matrix_version : 0;
+        }
+        graphic_batch_draw(visual->vertecies, visual->texture, &visual->cached_mvp, visual->color);
+    }
+    graphic_batch_flush();
 }
 
+
 /* HITRECT */
 void comp_hitrect_set_default(struct comp_hitrect *hitrect)
 {
     hitrect->cached_matrix_inv  = MAT4_IDENTITY;
     hitrect->cached_version     = 0;
+    hitrect->invertible         = 1;
+    hitrect->index_state        = HITRECT_UNINDEXED;
+    hitrect->pointer            = 0;
 
     hitrect->type               = HITRECT_CAMSPACE;
     hitrect->rect               = RECT2D_ZERO;
@@ -447,21 +972,231 @@ void comp_hitrect_set_default(struct comp_hitrect *hitrect)
 struct comp_system_hitrect *comp_system_hitrect_create(struct comp_system base, struct comp_system_transform *sys_transf)
 {
     struct comp_system_hitrect *sys = malloc(sizeof(struct comp_system_hitrect));
+    int i, j;
     if (!sys)
         return NULL;
 
     sys->base = base;
     sys->sys_transf = sys_transf;
     comp_pool_hitrect_init(&sys->pool, COMP_POOL_INITIAL_ALLOC);
+    memset(&sys->join, 0, sizeof(struct comp_transform_join));
+
+    sys->grids[HITRECT_ORTHOSPACE].cell_size = HITRECT_GRID_CELL_ORTHO;
+    sys->grids[HITRECT_CAMSPACE].cell_size   = HITRECT_GRID_CELL_CAMSPACE;
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < HITRECT_GRID_BUCKETS; j++)
+            entity_list_init(&sys->grids[i].buckets[j], 0);
+        entity_list_init(&sys->grids[i].unbounded, 0);
+    }
+    sys->indexed_sync_count = 0;
+    sys->index_stale = 1;
+
+    entity_list_init(&sys->hovered, 0);
+    entity_list_init(&sys->hits, 0);
+    entity_list_init(&sys->fired, 0);
+    entity_list_init(&sys->signalled, 0);
+    sys->pointer_valid = 0;
+    sys->pointer_held = 0;
     return sys;
 }
-DEFINE_POOL_BASED_EMPLACE_ERASE_GET(hitrect)
-void comp_system_hitrect_clear_states(struct comp_system_hitrect *sys)
+
+/* Clamped so far off or degenerate coordinates still fit the short cell range */
+static int hitrect_grid_cell(const struct hitrect_grid *grid, float coord)
 {
-    int i;
+    float cell = floorf(coord / grid->cell_size);
+    if (!(cell > -HITRECT_GRID_CELL_LIMIT))
+        return -HITRECT_GRID_CELL_LIMIT;
+    if (cell > HITRECT_GRID_CELL_LIMIT)
+        return HITRECT_GRID_CELL_LIMIT;
+    return (int)cell;
+}
+static struct entity_list *hitrect_grid_bucket(struct hitrect_grid *grid, int cell_x, int cell_y)
+{
+    unsigned int hash = ((unsigned int)cell_x * 73856093u) ^ ((unsigned int)cell_y * 19349663u);
+    return grid->buckets + hash % HITRECT_GRID_BUCKETS;
+}
+static void entity_list_remove_all(struct entity_list *list, entity_t entity)
+{
+    size_t i = 0;
+    while (i < list->len) {
+        if (list->elems[i] == entity)
+            list->elems[i] = list->elems[--list->len];
+        else
+            i++;
+    }
+}
+static void entity_list_push_unique(struct entity_list *list, entity_t entity)
+{
+    size_t i;
+    for (i = 0; i < list->len; i++)
+        if (list->elems[i] == entity)
+            return;
+    *entity_list_emplace(list, 1) = entity;
+}
+static void hitrect_unindex(struct comp_system_hitrect *sys, entity_t entity, struct comp_hitrect *hitrect)
+{
+    struct hitrect_grid *grid = sys->grids + hitrect->indexed_type;
+    int x, y;
+
+    if (hitrect->index_state == HITRECT_INDEXED_UNBOUNDED) {
+        entity_list_remove_all(&grid->unbounded, entity);
+    } else if (hitrect->index_state == HITRECT_INDEXED_CELLS) {
+        for (y = hitrect->cells[1]; y <= hitrect->cells[3]; y++)
+            for (x = hitrect->cells[0]; x <= hitrect->cells[2]; x++)
+                entity_list_remove_all(hitrect_grid_bucket(grid, x, y), entity);
+    }
+    hitrect->index_state = HITRECT_UNINDEXED;
+}
+/* Grid space bounds of the rect's corners under matrix, 0 if they can't be bounded.
+ * Ortho picking ignores the rect's local z, so a rect whose z axis leans off
+ * the view direction is hit along a slanted sweep and can't be bounded either */
+static int hitrect_bounds(const struct comp_hitrect *hitrect, const mat4 *matrix, float *min_xy, float *max_xy)
+{
+    const float CORNERS[4][2] = {
+        { hitrect->rect.x0, hitrect->rect.y0 }, { hitrect->rect.x1, hitrect->rect.y0 },
+        { hitrect->rect.x0, hitrect->rect.y1 }, { hitrect->rect.x1, hitrect->rect.y1 },
+    };
+    vec3  corner;
+    float x, y;
+    int   i;
+
+    if (hitrect->type == HITRECT_ORTHOSPACE && (matrix->m[0][2] != 0 || matrix->m[1][2] != 0))
+        return 0;
+
+    for (i = 0; i < 4; i++) {
+        corner = vec3_mult_mat4(*matrix, vec3_create(CORNERS[i][0], CORNERS[i][1], 0), 1);
+        x = corner.x;
+        y = corner.y;
+        if (hitrect->type == HITRECT_CAMSPACE) {
+            if (corner.z >= 0)
+                return 0;
+            x /= -corner.z;
+            y /= -corner.z;
+        }
+        if (!i || x < min_xy[0]) min_xy[0] = x;
+        if (!i || y < min_xy[1]) min_xy[1] = y;
+        if (!i || x > max_xy[0]) max_xy[0] = x;
+        if (!i || y > max_xy[1]) max_xy[1] = y;
+    }
+    return 1;
+}
+static void hitrect_index(struct comp_system_hitrect *sys, entity_t entity, struct comp_hitrect *hitrect, const mat4 *matrix)
+{
+    struct hitrect_grid *grid = sys->grids + hitrect->type;
+    float min_xy[2], max_xy[2];
+    int   cells[4], x, y;
+
+    hitrect->indexed_type = hitrect->type;
+    if (hitrect_bounds(hitrect, matrix, min_xy, max_xy)) {
+        cells[0] = hitrect_grid_cell(grid, min_xy[0]);
+        cells[1] = hitrect_grid_cell(grid, min_xy[1]);
+        cells[2] = hitrect_grid_cell(grid, max_xy[0]);
+        cells[3] = hitrect_grid_cell(grid, max_xy[1]);
+
+        if (cells[2] - cells[0] < HITRECT_GRID_MAX_SPAN && cells[3] - cells[1] < HITRECT_GRID_MAX_SPAN) {
+            for (y = cells[1]; y <= cells[3]; y++)
+                for (x = cells[0]; x <= cells[2]; x++)
+                    entity_list_push_unique(hitrect_grid_bucket(grid, x, y), entity);
+            for (x = 0; x < 4; x++)
+                hitrect->cells[x] = (short)cells[x];
+            hitrect->index_state = HITRECT_INDEXED_CELLS;
+            return;
+        }
+    }
+    *entity_list_emplace(&grid->unbounded, 1) = entity;
+    hitrect->index_state = HITRECT_INDEXED_UNBOUNDED;
+}
+/* Only runs after transforms were synced or the pools changed, then only
+ * rects whose transform matrix moved since they were indexed are touched.
+ * Returns 1 if any rect may have moved under the pointer */
+static int comp_system_hitrect_refresh_index(struct comp_system_hitrect *sys)
+{
+    struct comp_hitrect   *hitrect;
+    struct comp_transform *transf;
+    /* A transform emplaced in place of an erased one restarts its matrix_version */
+    char  transf_changed = !sys->join.built || sys->join.transf_layout_version != sys->sys_transf->pool.layout_version;
+    char  layout_changed = transf_changed || sys->join.layout_version != sys->pool.layout_version;
+    char  moved = layout_changed || sys->index_stale;
+    int   i;
+
+    if (comp_transform_join_update(&sys->join, sys->pool.dense, sys->pool.len,
+                                   sys->pool.layout_version, &sys->sys_transf->pool) != 0)
+        return -1;
+    if (!moved && sys->indexed_sync_count == sys->sys_transf->sync_count)
+        return 0;
+
     for (i = 0; i < sys->pool.len; i++) {
-        sys->pool.data[i].state = 0;
+        hitrect = sys->pool.data + i;
+        transf  = sys->join.slots[i] != -1 ? sys->sys_transf->pool.data + sys->join.slots[i] : NULL;
+
+        if (!transf) {
+            hitrect_unindex(sys, sys->pool.dense[i], hitrect);
+            continue;
+        }
+        if (!transf_changed && hitrect->index_state != HITRECT_UNINDEXED && hitrect->cached_version == transf->matrix_version)
+            continue;
+
+        hitrect_unindex(sys, sys->pool.dense[i], hitrect);
+        hitrect->cached_version = transf->matrix_version;
+        hitrect->invertible     = mat4_invert_affine(&transf->matrix, &hitrect->cached_matrix_inv) == 0;
+        if (hitrect->invertible)
+            hitrect_index(sys, sys->pool.dense[i], hitrect, &transf->matrix);
+        moved = 1;
+    }
+    sys->indexed_sync_count = sys->sys_transf->sync_count;
+    sys->index_stale = 0;
+    return moved;
+}
+struct comp_hitrect *comp_system_hitrect_emplace(struct comp_system_hitrect *sys, entity_t entity)
+{
+    struct comp_hitrect *hitrect = comp_pool_hitrect_emplace(&sys->pool, entity);
+    if (!hitrect)
+        return NULL;
+
+    hitrect->index_state = HITRECT_UNINDEXED;
+    entity_record_flag_component(sys->base.entity_record, entity, sys->base.component_flag);
+    return hitrect;
+}
+void comp_system_hitrect_erase(struct comp_system_hitrect *sys, entity_t entity)
+{
+    struct comp_hitrect *hitrect = comp_pool_hitrect_try_get(&sys->pool, entity);
+    if (!hitrect)
+        return;
+
+    hitrect_unindex(sys, entity, hitrect);
+    if (hitrect->pointer & HITRECT_POINTER_OVER)
+        entity_list_remove_all(&sys->hovered, entity);
+    if (hitrect->pointer & HITRECT_POINTER_SIGNALLED)
+        entity_list_remove_all(&sys->signalled, entity);
+    if (comp_pool_hitrect_erase(&sys->pool, entity) == 0)
+        entity_record_unflag_component(sys->base.entity_record, entity, sys->base.component_flag);
+}
+struct comp_hitrect *comp_system_hitrect_get(struct comp_system_hitrect *sys, entity_t entity)
+{
+    return comp_pool_hitrect_try_get(&sys->pool, entity);
+}
+void comp_system_hitrect_reindex(struct comp_system_hitrect *sys, entity_t entity)
+{
+    struct comp_hitrect *hitrect = comp_pool_hitrect_try_get(&sys->pool, entity);
+    if (!hitrect)
+        return;
+
+    hitrect_unindex(sys, entity, hitrect);
+    sys->index_stale = 1;
+}
+void comp_system_hitrect_clear_states(struct comp_system_hitrect *sys)
+{
+    struct comp_hitrect *hitrect;
+    size_t i;
+
+    for (i = 0; i < sys->signalled.len; i++) {
+        hitrect = comp_pool_hitrect_try_get(&sys->pool, sys->signalled.elems[i]);
+        if (!hitrect)
+            continue;
+        hitrect->state    = 0;
+        hitrect->pointer &= ~HITRECT_POINTER_SIGNALLED;
     }
+    entity_list_clear(&sys->signalled);
 }
 int comp_system_hitrect_check_and_clear_state(struct comp_system_hitrect *sys, entity_t entity)
 {
@@ -472,44 +1207,139 @@ int comp_system_hitrect_check_and_clear_state(struct comp_system_hitrect *sys, e
     hitrect->state = 0;
     return 1;
 }
-void comp_system_hitrect_update(struct comp_system_hitrect *system, const vec2 *mouse_ortho, const vec3 *mouse_camspace_ray, char mask)
+static void hitrect_signal(struct comp_system_hitrect *sys, entity_t entity, struct comp_hitrect *hitrect, unsigned char transition)
 {
-    struct comp_hitrect   *hitrect;
-    struct comp_transform *transf;
-    int i;
+    if (!hitrect->active || !(hitrect->hitmask & transition))
+        return;
+
+    hitrect->state |= transition;
+    if (!(hitrect->pointer & HITRECT_POINTER_SIGNALLED))
+        *entity_list_emplace(&sys->signalled, 1) = entity;
+    if (!(hitrect->pointer & HITRECT_POINTER_FIRED))
+        *entity_list_emplace(&sys->fired, 1) = entity;
+    hitrect->pointer |= HITRECT_POINTER_SIGNALLED | HITRECT_POINTER_FIRED;
+}
+/* Being under the pointer is geometric only, rects that are inactive or
+ * masked out still count so they take presses once they're switched on */
+static void hitrect_collect_candidates(struct comp_system_hitrect *system, const struct entity_list *candidates,
+                                       int cell_x, int cell_y, char bounded, const vec2 *mouse_ortho, const vec3 *mouse_camspace_ray)
+{
+    struct comp_hitrect *hitrect;
+    int    hit;
+    size_t i;
+
+    for (i = 0; i < candidates->len; i++) {
+        hitrect = comp_pool_hitrect_try_get(&system->pool, candidates->elems[i]);
+        if (!hitrect || !hitrect->invertible)
+            continue;
 
-    for (i = 0; i < system->pool.len; i++) {
-        hitrect = system->pool.data + i;
-        if (hitrect->state)
+        /* Bucket neighbours hashed from other cells */
+        if (bounded && (cell_x < hitrect->cells[0] || cell_x > hitrect->cells[2]
+                     || cell_y < hitrect->cells[1] || cell_y > hitrect->cells[3]))
             continue;
 
-        transf  = comp_system_transform_get(system->sys_transf, system->pool.dense[i]);
+        if (hitrect->type == HITRECT_CAMSPACE)
+            hit = origin_ray_intersects_rect(&hitrect->rect, &hitrect->cached_matrix_inv, *mouse_camspace_ray);
+        else 
+            hit = point_lands_on_rect(&hitrect->rect, &hitrect->cached_matrix_inv, vec3_create(mouse_ortho->x, mouse_ortho->y, 0));
+
+        if (hit)
+            *entity_list_emplace(&system->hits, 1) = candidates->elems[i];
+    }
+}
+static void hitrect_retest_pointer(struct comp_system_hitrect *system, const vec2 *mouse_ortho, const vec3 *mouse_camspace_ray)
+{
+    const unsigned char ENTER = system->pointer_held ? HITMASK_MOUSE_HOLD : HITMASK_MOUSE_HOVER;
+    struct comp_hitrect *hitrect;
+    struct hitrect_grid *grid;
+    struct entity_list   swap;
+    int cell_x, cell_y;
+    size_t i;
+
+    entity_list_clear(&system->hits);
+
+    grid   = system->grids + HITRECT_ORTHOSPACE;
+    cell_x = hitrect_grid_cell(grid, mouse_ortho->x);
+    cell_y = hitrect_grid_cell(grid, mouse_ortho->y);
+    hitrect_collect_candidates(system, hitrect_grid_bucket(grid, cell_x, cell_y), cell_x, cell_y, 1, mouse_ortho, mouse_camspace_ray);
+    hitrect_collect_candidates(system, &grid->unbounded, 0, 0, 0, mouse_ortho, mouse_camspace_ray);
+
+    /* The narrow test intersects the whole line through the origin, so the
+     * ray lands on the z = -1 plane whichever way it points. A line inside
+     * z = 0 can't reach bounded rects, those lie entirely in front */
+    grid = system->grids + HITRECT_CAMSPACE;
+    if (mouse_camspace_ray->z != 0) {
+        cell_x = hitrect_grid_cell(grid, mouse_camspace_ray->x / -mouse_camspace_ray->z);
+        cell_y = hitrect_grid_cell(grid, mouse_camspace_ray->y / -mouse_camspace_ray->z);
+        hitrect_collect_candidates(system, hitrect_grid_bucket(grid, cell_x, cell_y), cell_x, cell_y, 1, mouse_ortho, mouse_camspace_ray);
+    }
+    hitrect_collect_candidates(system, &grid->unbounded, 0, 0, 0, mouse_ortho, mouse_camspace_ray);
 
-        if (!transf || !hitrect->active || !(hitrect->hitmask & mask))
+    for (i = 0; i < system->hits.len; i++) {
+        hitrect = comp_pool_hitrect_try_get(&system->pool, system->hits.elems[i]);
+        if (!(hitrect->pointer & HITRECT_POINTER_OVER))
+            hitrect_signal(system, system->hits.elems[i], hitrect, ENTER);
+        hitrect->pointer |= HITRECT_POINTER_OVER | HITRECT_POINTER_SEEN;
+    }
+    for (i = 0; i < system->hovered.len; i++) {
+        hitrect = comp_pool_hitrect_try_get(&system->pool, system->hovered.elems[i]);
+        if (!hitrect || (hitrect->pointer & HITRECT_POINTER_SEEN) || !(hitrect->pointer & HITRECT_POINTER_OVER))
             continue;
+        hitrect->pointer &= ~HITRECT_POINTER_OVER;
+        hitrect_signal(system, system->hovered.elems[i], hitrect, HITMASK_MOUSE_LEAVE);
+    }
+    for (i = 0; i < system->hits.len; i++)
+        comp_pool_hitrect_try_get(&system->pool, system->hits.elems[i])->pointer &= ~HITRECT_POINTER_SEEN;
 
-        if (hitrect->cached_version != transf->matrix_version) {
-            hitrect->cached_version = transf->matrix_version;
+    swap             = system->hovered;
+    system->hovered  = system->hits;
+    system->hits     = swap;
+}
+void comp_system_hitrect_update(struct comp_system_hitrect *system, const vec2 *mouse_ortho, const vec3 *mouse_camspace_ray, char mask)
+{
+    struct comp_hitrect *hitrect;
+    int    moved;
+    size_t i;
 
-            if (!HAS_0_SCALE(*transf))
-                hitrect->cached_matrix_inv = mat4_invert(transf->matrix);
-            else
-                cuno_logf(LOG_WARN, "COMP_HITRECT: Entity %d matrix is non-invertable due to zero scale component(s)", system->pool.dense[i]);
-        }
+    moved = comp_system_hitrect_refresh_index(system);
+    if (moved < 0)
+        return;
+    moved = moved || !system->pointer_valid
+            || system->pointer_ortho.x != mouse_ortho->x || system->pointer_ortho.y != mouse_ortho->y
+            || system->pointer_ray.x != mouse_camspace_ray->x || system->pointer_ray.y != mouse_camspace_ray->y
+            || system->pointer_ray.z != mouse_camspace_ray->z;
+
+    entity_list_clear(&system->fired);
+    if (moved) {
+        hitrect_retest_pointer(system, mouse_ortho, mouse_camspace_ray);
+        system->pointer_ortho = *mouse_ortho;
+        system->pointer_ray   = *mouse_camspace_ray;
+        system->pointer_valid = 1;
+    }
 
-        if (hitrect->type == HITRECT_CAMSPACE)
-            hitrect->state = origin_ray_intersects_rect(&hitrect->rect, &hitrect->cached_matrix_inv, *mouse_camspace_ray) ? mask : 0;
-        else 
-            hitrect->state = point_lands_on_rect(&hitrect->rect, &hitrect->cached_matrix_inv, vec3_create(mouse_ortho->x, mouse_ortho->y, 0)) ? mask : 0;
+    if (mask == HITMASK_MOUSE_DOWN || mask == HITMASK_MOUSE_UP) {
+        for (i = 0; i < system->hovered.len; i++) {
+            hitrect = comp_pool_hitrect_try_get(&system->pool, system->hovered.elems[i]);
+            if (hitrect)
+                hitrect_signal(system, system->hovered.elems[i], hitrect, mask);
+        }
     }
+    system->pointer_held = mask == HITMASK_MOUSE_DOWN || mask == HITMASK_MOUSE_HOLD;
 
-    for (i = 0; i < system->pool.len; i++) {
-        hitrect = system->pool.data + i;
+    /* Handlers may touch the pool, so hits are looked up again and erased
+     * rects simply drop out */
+    for (i = 0; i < system->fired.len; i++) {
+        hitrect = comp_pool_hitrect_try_get(&system->pool, system->fired.elems[i]);
+        if (!hitrect)
+            continue;
+        hitrect->pointer &= ~HITRECT_POINTER_FIRED;
         if (hitrect->hit_handler && hitrect->state)
-            hitrect->hit_handler(system->pool.dense[i], hitrect);
+            hitrect->hit_handler(system->fired.elems[i], hitrect);
     }
+    entity_list_clear(&system->fired);
 }
 
+
 /* INTERPOLATOR */
 void comp_interpolator_set_default(struct comp_interpolator *interpolator)
 {
@@ -532,6 +1362,7 @@ struct comp_system_interpolator *comp_system_interpolator_create(struct comp_sys
     sys->base = base;
     sys->sys_transf = sys_transf;
     comp_pool_interpolator_init(&sys->pool, COMP_POOL_INITIAL_ALLOC);
+    memset(&sys->join, 0, sizeof(struct comp_transform_join));
     return sys;
 }
 DEFINE_POOL_BASED_EMPLACE_ERASE_GET(interpolator)
@@ -633,6 +1464,12 @@ void comp_system_interpolator_update(struct comp_system_interpolator *sys)
                                 factor;
     vec3                        factor_vec;
     double                      now = get_monotonic_time();
+    const int                  *transf_slots;
+
+    if (comp_transform_join_update(&sys->join, sys->pool.dense, sys->pool.len,
+                                   sys->pool.layout_version, &sys->sys_transf->pool) != 0)
+        return;
+    transf_slots = sys->join.slots;
 
     for (i = 0; i < sys->pool.len; i++) {
         interp = sys->pool.data + i;
@@ -641,7 +1478,7 @@ void comp_system_interpolator_update(struct comp_system_interpolator *sys)
         elapsed = now - interp->start_time;
 
         entity = sys->pool.dense[i];
-        transf = comp_pool_transform_try_get(&sys->sys_transf->pool, entity);
+        transf = transf_slots[i] != -1 ? sys->sys_transf->pool.data + transf_slots[i] : NULL;
         if (!transf) {
             cuno_logf(LOG_WARN, "COMP_INTERP: transform for entity %d doesn't exist. Can't lerp.", entity);
             continue;
@@ -1,27 +1,98 @@
 #ifndef COMPONENT_H
 #define COMPONENT_H
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "engine/system/log.h"
 #include "engine/system/graphic.h"
 #include "engine/math.h"
 #include "engine/array_list.h"
 
-#define ENTITY_MAX          8192
-#define ENTITY_INVALID      ENTITY_MAX
+/* Handles pack a slot index under the slot's generation, a recycled slot
+ * hands out a new generation so stale handles stop resolving */
+#define ENTITY_INDEX_BITS       20
+#define ENTITY_INDEX_MASK       ((1u << ENTITY_INDEX_BITS) - 1)
+#define ENTITY_GENERATION_MASK  ((1u << (32 - ENTITY_INDEX_BITS)) - 1)
 
-#define entity_is_invalid(entity) (entity == ENTITY_INVALID || entity > ENTITY_MAX)
+/* The last index is left out so ENTITY_INVALID never names a slot */
+#define ENTITY_MAX          ENTITY_INDEX_MASK
+#define ENTITY_INVALID      ((entity_t)-1)
 
-#define entity_record_init(entrec_ptr) memset(entrec_ptr, 0, sizeof(struct entity_record))
-#define entity_record_flag_component(entrec_ptr, entity, flag) (entrec_ptr)->component_flags[entity] |= flag
-#define entity_record_unflag_component(entrec, entity, flag) (entrec)->component_flags[entity] &= ~(flag)
+#define ENTITY_PAGE_BITS    8
+#define ENTITY_PAGE_LEN     (1u << ENTITY_PAGE_BITS)
 
+#define entity_index(entity) ((entity) & ENTITY_INDEX_MASK)
+#define entity_generation(entity) ((entity) >> ENTITY_INDEX_BITS)
+#define entity_make(index, generation) ((entity_t)((generation) << ENTITY_INDEX_BITS | (index)))
+#define entity_is_invalid(entity) (entity_index(entity) >= ENTITY_MAX)
+
+#define entity_record_flag_component(entrec_ptr, entity, flag) (entrec_ptr)->component_flags[entity_index(entity)] |= flag
+#define entity_record_unflag_component(entrec, entity, flag) (entrec)->component_flags[entity_index(entity)] &= ~(flag)
+
+/* Per-slot values kept in pages of ENTITY_PAGE_LEN that are only allocated once
+ * written to, reads that land on a missing page see the fill value.
+ * A zeroed map is empty, _at returns NULL when a page can't be allocated */
+#define DEFINE_ENTITY_MAP(static_inline, type, name, fill) \
+    struct name { \
+        type          **pages; \
+        size_t          page_len; \
+    }; \
+    static_inline type name##_get(const struct name *map, entity_t index) \
+    { \
+        const size_t PAGE = index >> ENTITY_PAGE_BITS; \
+        if (PAGE >= map->page_len || !map->pages[PAGE]) \
+            return fill; \
+        return map->pages[PAGE][index & (ENTITY_PAGE_LEN - 1)]; \
+    } \
+    static_inline type *name##_at(struct name *map, entity_t index) \
+    { \
+        const size_t PAGE = index >> ENTITY_PAGE_BITS; \
+        type  **pages; \
+        size_t  i; \
+        if (PAGE >= map->page_len) { \
+            pages = realloc(map->pages, (PAGE + 1) * sizeof(type *)); \
+            if (!pages) \
+                return NULL; \
+            memset(pages + map->page_len, 0, (PAGE + 1 - map->page_len) * sizeof(type *)); \
+            map->pages    = pages; \
+            map->page_len = PAGE + 1; \
+        } \
+        if (!map->pages[PAGE]) { \
+            map->pages[PAGE] = malloc(ENTITY_PAGE_LEN * sizeof(type)); \
+            if (!map->pages[PAGE]) \
+                return NULL; \
+            for (i = 0; i < ENTITY_PAGE_LEN; i++) \
+                map->pages[PAGE][i] = fill; \
+        } \
+        return map->pages[PAGE] + (index & (ENTITY_PAGE_LEN - 1)); \
+    } \
+    static_inline void name##_deinit(struct name *map) \
+    { \
+        size_t i; \
+        for (i = 0; i < map->page_len; i++) \
+            free(map->pages[i]); \
+        free(map->pages); \
+        map->pages    = NULL; \
+        map->page_len = 0; \
+    }
+
+typedef uint32_t entity_t;
+typedef unsigned int component_flag_t;
+
+DEFINE_ENTITY_MAP(static, int, entity_slot_map, -1)
+DEFINE_ENTITY_MAP(static, entity_t, entity_link_map, ENTITY_INVALID)
+
+/* sparse maps an entity's index to its slot in the dense arrays,
+ * dense keeps whole handles so stale ones are caught on lookup.
+ * layout_version moves whenever an entity gains, loses or changes its slot */
 #define DEFINE_COMPONENT_POOL_STRUCT(type, name) \
     struct name { \
-        short           sparse[ENTITY_MAX]; \
-        entity_t        dense[ENTITY_MAX]; \
-        size_t          len, \
-                        allocated_len; \
-        type           *data; \
+        struct entity_slot_map  sparse; \
+        entity_t               *dense; \
+        size_t                  len, \
+                                allocated_len; \
+        unsigned int            layout_version; \
+        type                   *data; \
     };
 #define DEFINE_COMPONENT_POOL_INIT(type, name) \
     int name##_init(struct name *pool, size_t initial_alloc_len) \
@@ -46,9 +117,13 @@
 #define DEFINE_COMPONENT_POOL_TRY_GET(type, name) \
     type *name##_try_get(struct name *pool, entity_t entity) \
     { \
-        if (entity == ENTITY_INVALID || pool->sparse[entity] == -1) \
+        int slot; \
+        if (entity_is_invalid(entity)) \
+            return NULL; \
+        slot = entity_slot_map_get(&pool->sparse, entity_index(entity)); \
+        if (slot == -1 || pool->dense[slot] != entity) \
             return NULL; \
-        return pool->data + pool->sparse[entity];  \
+        return pool->data + slot;  \
     }
 #define DEFINE_COMPONENT_POOL(static_inline, type, name) \
     DEFINE_COMPONENT_POOL_STRUCT(type, name) \
@@ -59,55 +134,146 @@
     static_inline DEFINE_COMPONENT_POOL_TRY_GET(type, name)
 
 
-typedef unsigned short entity_t;
-typedef unsigned int component_flag_t;
-
+/* Free slots form a stack of indices threaded through free_next, slots past len
+ * were never handed out and the arrays grow with len.
+ * Each slot's generation moves on whenever it is deactivated */
 struct entity_record {
-    char                active[ENTITY_MAX];
-    component_flag_t    component_flags[ENTITY_MAX];
+    char               *active;
+    component_flag_t   *component_flags;
+    unsigned short     *generation;
+    entity_t           *free_next;
+    entity_t            free_head;
+    size_t              len,
+                        allocated_len;
 };
 
+static inline int entity_record_is_alive(const struct entity_record *entrec, entity_t entity)
+{
+    return entity_index(entity) < entrec->len
+        && entrec->active[entity_index(entity)]
+        && entrec->generation[entity_index(entity)] == entity_generation(entity);
+}
+
+static void entity_record_init(struct entity_record *entrec)
+{
+    memset(entrec, 0, sizeof(struct entity_record));
+    entrec->free_head = ENTITY_INVALID;
+}
+static void entity_record_deinit(struct entity_record *entrec)
+{
+    free(entrec->active);
+    free(entrec->component_flags);
+    free(entrec->generation);
+    free(entrec->free_next);
+    entity_record_init(entrec);
+}
+static int entity_record_grow(struct entity_record *entrec)
+{
+    const size_t NEW_LEN = entrec->allocated_len ? entrec->allocated_len * 2 : ENTITY_PAGE_LEN;
+    void *active, *flags, *generation, *free_next;
+
+    if ((active = realloc(entrec->active, NEW_LEN * sizeof(char))))
+        entrec->active = active;
+    if ((flags = realloc(entrec->component_flags, NEW_LEN * sizeof(component_flag_t))))
+        entrec->component_flags = flags;
+    if ((generation = realloc(entrec->generation, NEW_LEN * sizeof(unsigned short))))
+        entrec->generation = generation;
+    if ((free_next = realloc(entrec->free_next, NEW_LEN * sizeof(entity_t))))
+        entrec->free_next = free_next;
+
+    if (!active || !flags || !generation || !free_next)
+        return -1;
+    entrec->allocated_len = NEW_LEN;
+    return 0;
+}
 static entity_t entity_record_activate(struct entity_record *entrec)
 {
-    int i;
-    for (i = 0; i < ENTITY_MAX; i++)
-        if (!entrec->active[i]) {
-            entrec->active[i] = 1;
-            return i;
-        }
-    cuno_logf(LOG_WARN, "ENTREC: recorded entity hit ENTITY_MAX");
-    return ENTITY_INVALID;
+    entity_t index;
+
+    if (entrec->free_head != ENTITY_INVALID) {
+        index = entrec->free_head;
+        entrec->free_head = entrec->free_next[index];
+    } else if (entrec->len >= ENTITY_MAX) {
+        cuno_logf(LOG_WARN, "ENTREC: recorded entity hit ENTITY_MAX");
+        return ENTITY_INVALID;
+    } else if (entrec->len == entrec->allocated_len && entity_record_grow(entrec) != 0) {
+        cuno_logf(LOG_ERR, "ENTREC: Failed to grow past %zu entities", entrec->len);
+        return ENTITY_INVALID;
+    } else {
+        index = entrec->len++;
+        entrec->component_flags[index] = 0;
+        entrec->generation[index]      = 0;
+    }
+    entrec->active[index] = 1;
+    return entity_make(index, (entity_t)entrec->generation[index]);
 }
+/* Stale handles are refused, they would otherwise free the slot's new owner */
 static int entity_record_deactivate(struct entity_record *entrec, entity_t entity)
 {
-    if (entrec->component_flags[entity]) {
-        cuno_logf(LOG_WARN, "ENTREC: entity %d can't deactivate due to its non-zero component flags (%d)", entity, entrec->component_flags[entity]);
+    const entity_t INDEX = entity_index(entity);
+
+    if (!entity_record_is_alive(entrec, entity))
+        return -1;
+    if (entrec->component_flags[INDEX]) {
+        cuno_logf(LOG_WARN, "ENTREC: entity %u can't deactivate due to its non-zero component flags (%d)", INDEX, entrec->component_flags[INDEX]);
         return -1;
     }
-    return entrec->active[entity] = 0;
+    entrec->active[INDEX]       = 0;
+    entrec->generation[INDEX]   = (entrec->generation[INDEX] + 1) & ENTITY_GENERATION_MASK;
+    entrec->free_next[INDEX]    = entrec->free_head;
+    entrec->free_head           = INDEX;
+    return 0;
+}
+/* Returns how many of len were activated, fewer only once ENTITY_MAX is hit */
+static size_t entity_record_activate_many(struct entity_record *entrec, entity_t *entities, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        entities[i] = entity_record_activate(entrec);
+        if (entities[i] == ENTITY_INVALID)
+            break;
+    }
+    return i;
+}
+static void entity_record_deactivate_many(struct entity_record *entrec, const entity_t *entities, size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++)
+        entity_record_deactivate(entrec, entities[i]);
 }
 DEFINE_ARRAY_LIST_WRAPPER(static, entity_t, entity_list)
 
 
 
+/* Pointer transitions a hitrect can be signalled with. DOWN and UP fire on
+ * the rects under the pointer when the button is pressed or released, HOVER
+ * and HOLD when the pointer enters a rect with the button up or held, and
+ * LEAVE when it stops being over one */
 /* #define HITMASK_EXCLUSIVE   1<<0 */
 #define HITMASK_MOUSE_DOWN  1<<1
 #define HITMASK_MOUSE_UP    1<<2
 #define HITMASK_MOUSE_HOVER 1<<3
 #define HITMASK_MOUSE_HOLD  1<<4
+#define HITMASK_MOUSE_LEAVE 1<<5
 
 struct comp_system {
     struct entity_record   *entity_record;
     component_flag_t        component_flag;
 };
 struct comp_system_family_view {
-    const entity_t   *parent_map;
-    const entity_t   *first_child_map;
-    const entity_t   *sibling_map;
+    const struct entity_link_map   *parent_map;
+    const struct entity_link_map   *first_child_map;
+    const struct entity_link_map   *sibling_map;
 };
+#define comp_family_view_parent(view, entity)       entity_link_map_get((view).parent_map, entity_index(entity))
+#define comp_family_view_first_child(view, entity)  entity_link_map_get((view).first_child_map, entity_index(entity))
+#define comp_family_view_sibling(view, entity)      entity_link_map_get((view).sibling_map, entity_index(entity))
+/* Changes to data take effect after comp_system_transform_desync queues the
+ * entity, queued keeps it from being queued twice between syncs */
 struct comp_transform {
     struct transform            data;
     char                        synced;
+    char                        queued;
 
     unsigned short              matrix_version;
     mat4                        matrix;
@@ -121,7 +287,13 @@ enum draw_pass_type {
     DRAW_PASS_OPAQUE,
     DRAW_PASS_TRANSPARENT,
 };
+/* cached_mvp is kept by comp_system_visual_draw, it's reused while neither
+ * the transform's matrix_version nor the projection moved */
 struct comp_visual {
+    mat4                        cached_mvp;
+    unsigned short              cached_version;
+    unsigned int                cached_proj_version;
+
     struct graphic_vertecies   *vertecies;
     struct graphic_texture     *texture;
     vec3                        color;
@@ -131,13 +303,22 @@ enum hitrect_type {
     HITRECT_CAMSPACE, 
     HITRECT_ORTHOSPACE,
 };
+/* cached_matrix_inv follows the transform's matrix_version, a transform
+ * that flattens the rect (zero scale) leaves it uninvertible and unhittable.
+ * The picking grid is keyed on the same version, so changing rect or type
+ * on an indexed hitrect needs comp_system_hitrect_reindex */
 struct comp_hitrect {
     mat4                        cached_matrix_inv;
     unsigned short              cached_version;
+    char                        invertible;
+    unsigned char               index_state;
+    unsigned char               indexed_type;
+    short                       cells[4];           /* Grid cells covered, x0 y0 x1 y1 inclusive */
 
     rect2D                      rect;
     enum hitrect_type           type;
-    unsigned char               state;
+    unsigned char               state;              /* Transitions signalled since the last clear */
+    unsigned char               pointer;
     unsigned char               hitmask;
     unsigned char               tag;
     unsigned char               active;
@@ -191,6 +372,7 @@ struct comp_system_hitrect *comp_system_hitrect_create(struct comp_system base,
 struct comp_hitrect *comp_system_hitrect_emplace(struct comp_system_hitrect *sys, entity_t entity);
 void comp_system_hitrect_erase(struct comp_system_hitrect *sys, entity_t entity);
 struct comp_hitrect *comp_system_hitrect_get(struct comp_system_hitrect *sys, entity_t entity);
+void comp_system_hitrect_reindex(struct comp_system_hitrect *sys, entity_t entity);
 void comp_system_hitrect_clear_states(struct comp_system_hitrect *sys);
 int comp_system_hitrect_check_and_clear_state(struct comp_system_hitrect *sys, entity_t entity);
 void comp_system_hitrect_update(struct comp_system_hitrect *system, const vec2 *mouse_ortho, const vec3 *mouse_camspace_ray, char mask);
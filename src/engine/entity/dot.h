@@ -22,8 +22,11 @@ static inline entity_t entity_dot_attach_new(struct entity_world *ctx, entity_t
 
     comp_system_family_adopt(ctx->sys_fam, parent, dot);
 
+    /* adopting may reorder the transform pool */
+    transf               = comp_system_transform_get(ctx->sys_transf, dot);
     transform            = comp_system_transform_get_world(ctx->sys_transf, dot);
     transf->data.scale   = vec3_create(scale/transform.trans.x, scale/transform.trans.y, scale/transform.trans.z);
+    comp_system_transform_desync(ctx->sys_transf, dot);
 
     return dot;
 }
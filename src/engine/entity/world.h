@@ -49,7 +49,11 @@ static void entity_world_init(struct entity_world *world)
 
 void entity_world_cleanup(struct entity_world *world, entity_t entity)
 {
-    component_flag_t flags = world->records.component_flags[entity];
+    component_flag_t flags;
+
+    if (!entity_record_is_alive(&world->records, entity))
+        return;
+    flags = world->records.component_flags[entity_index(entity)];
     if (flags & COMPFLAG_SYS_FAMILY)
         comp_system_family_disown(world->sys_fam, entity);
     if (flags & COMPFLAG_SYS_TRANSFORM)
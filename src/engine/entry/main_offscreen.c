@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "engine/system/graphic.h"
+#include "engine/system/log.h"
+#include "engine/system/time.h"
+#include "engine/system/asset/asset_stdio.h"
+#include "engine/utils.h"
+#include "engine/game.h"
+
+#define OFFSCREEN_CLICKS_MAX 32
+
+/* A press and release at screen x, y before the given frame */
+struct offscreen_click {
+    int     frame;
+    float   x, y;
+};
+
+static void offscreen_print_usage(const char *exe)
+{
+    fprintf(stderr,
+            "usage: %s [-n frames] [-s WxH] [-a assets] [-c frame,x,y]... [-o frame.ppm]\n"
+            "  -n  frames to render, 300 by default\n"
+            "  -s  framebuffer size, 720x1600 by default\n"
+            "  -a  asset directory, ./assets by default\n"
+            "  -c  click at screen coordinates before a frame, can be repeated\n"
+            "  -o  dump the last frame as a PPM image\n", exe);
+}
+
+static void offscreen_click(float x, float y)
+{
+    struct mouse_event event;
+
+    event.mouse_x = x;
+    event.mouse_y = y;
+    event.type    = MOUSE_DOWN;
+    game_mouse_event(event);
+    event.type    = MOUSE_UP;
+    game_mouse_event(event);
+}
+
+int main(int argc, char *argv[])
+{
+    struct offscreen_click  clicks[OFFSCREEN_CLICKS_MAX];
+    struct graphic_session *session;
+    const char *dump_path = NULL;
+    int     frames = 300, width = 720, height = 1600;
+    int     clicks_len = 0, opt, i, j;
+    double  start, elapsed, total = 0, slowest = 0, fastest = 0;
+
+    while ((opt = getopt(argc, argv, "n:s:a:c:o:h")) != -1) {
+        switch (opt) {
+            case 'n': frames = atoi(optarg); break;
+            case 'a': asset_management_init(optarg); break;
+            case 'o': dump_path = optarg; break;
+            case 's':
+                if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                    offscreen_print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if (clicks_len == OFFSCREEN_CLICKS_MAX
+                        || sscanf(optarg, "%d,%f,%f", &clicks[clicks_len].frame, &clicks[clicks_len].x, &clicks[clicks_len].y) != 3) {
+                    offscreen_print_usage(argv[0]);
+                    return 1;
+                }
+                clicks_len++;
+                break;
+            default:
+                offscreen_print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (frames <= 0) {
+        offscreen_print_usage(argv[0]);
+        return 1;
+    }
+
+    session = graphic_session_create_offscreen(width, height);
+    if (!session) {
+        cuno_logf(LOG_ERR, "OFFSCREEN: No EGL pbuffer session");
+        return 1;
+    }
+    if (game_init(session) != 0) {
+        graphic_session_destroy(session);
+        return 1;
+    }
+
+    for (i = 0; i < frames; i++) {
+        for (j = 0; j < clicks_len; j++)
+            if (clicks[j].frame == i)
+                offscreen_click(clicks[j].x, clicks[j].y);
+
+        start = get_monotonic_time();
+        game_update();
+        elapsed = get_monotonic_time() - start;
+
+        total  += elapsed;
+        slowest = max(slowest, elapsed);
+        fastest = i ? min(fastest, elapsed) : elapsed;
+    }
+
+    printf("%d frames at %dx%d\n", frames, width, height);
+    printf("  frame      %.3f ms avg, %.3f ms min, %.3f ms max, %.1f fps\n",
+            total * 1e3 / frames, fastest * 1e3, slowest * 1e3, frames / total);
+
+    if (dump_path && graphic_session_dump_frame(session, dump_path) != 0) {
+        cuno_logf(LOG_ERR, "OFFSCREEN: Failed to dump the frame to \"%s\"", dump_path);
+        graphic_session_destroy(session);
+        return 1;
+    }
+    graphic_session_destroy(session);
+    return 0;
+}
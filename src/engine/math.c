@@ -2,6 +2,89 @@
 #include "engine/system/log.h"
 #include "engine/math.h"
 
+/* 4 wide float rows for the mat4 kernels, picked at build time.
+ * Every path does the same operations in the same order so results only
+ * differ where the scalar compiler contracts into fma */
+#if defined(__SSE2__) && !defined(CUNO_NO_SIMD)
+#include <emmintrin.h>
+#define MAT4_SIMD_PATH "sse2"
+typedef __m128 v4;
+static inline v4 v4_load(const float *p)          { return _mm_loadu_ps(p); }
+static inline void v4_store(float *p, v4 a)       { _mm_storeu_ps(p, a); }
+static inline v4 v4_splat(float f)                { return _mm_set1_ps(f); }
+static inline v4 v4_add(v4 a, v4 b)               { return _mm_add_ps(a, b); }
+static inline v4 v4_sub(v4 a, v4 b)               { return _mm_sub_ps(a, b); }
+static inline v4 v4_mul(v4 a, v4 b)               { return _mm_mul_ps(a, b); }
+static inline v4 v4_div(v4 a, v4 b)               { return _mm_div_ps(a, b); }
+typedef __m128i v4i;
+static inline v4i v4_round_int(v4 a)              { return _mm_cvtps_epi32(a); }
+static inline v4i v4i_and(v4i a, int mask)        { return _mm_and_si128(a, _mm_set1_epi32(mask)); }
+static inline v4 v4_from_int(v4i a)               { return _mm_cvtepi32_ps(a); }
+#elif defined(__aarch64__) && defined(__ARM_NEON) && !defined(CUNO_NO_SIMD)
+#include <arm_neon.h>
+#define MAT4_SIMD_PATH "neon"
+typedef float32x4_t v4;
+static inline v4 v4_load(const float *p)          { return vld1q_f32(p); }
+static inline void v4_store(float *p, v4 a)       { vst1q_f32(p, a); }
+static inline v4 v4_splat(float f)                { return vdupq_n_f32(f); }
+static inline v4 v4_add(v4 a, v4 b)               { return vaddq_f32(a, b); }
+static inline v4 v4_sub(v4 a, v4 b)               { return vsubq_f32(a, b); }
+static inline v4 v4_mul(v4 a, v4 b)               { return vmulq_f32(a, b); }
+static inline v4 v4_div(v4 a, v4 b)               { return vdivq_f32(a, b); }
+typedef int32x4_t v4i;
+static inline v4i v4_round_int(v4 a)              { return vcvtnq_s32_f32(a); }
+static inline v4i v4i_and(v4i a, int mask)        { return vandq_s32(a, vdupq_n_s32(mask)); }
+static inline v4 v4_from_int(v4i a)               { return vcvtq_f32_s32(a); }
+#else
+#define MAT4_SIMD_PATH "scalar"
+typedef struct { float f[4]; } v4;
+static inline v4 v4_load(const float *p)          { v4 r = {{ p[0], p[1], p[2], p[3] }}; return r; }
+static inline void v4_store(float *p, v4 a)       { p[0] = a.f[0]; p[1] = a.f[1]; p[2] = a.f[2]; p[3] = a.f[3]; }
+static inline v4 v4_splat(float f)                { v4 r = {{ f, f, f, f }}; return r; }
+static inline v4 v4_add(v4 a, v4 b)               { v4 r = {{ a.f[0]+b.f[0], a.f[1]+b.f[1], a.f[2]+b.f[2], a.f[3]+b.f[3] }}; return r; }
+static inline v4 v4_sub(v4 a, v4 b)               { v4 r = {{ a.f[0]-b.f[0], a.f[1]-b.f[1], a.f[2]-b.f[2], a.f[3]-b.f[3] }}; return r; }
+static inline v4 v4_mul(v4 a, v4 b)               { v4 r = {{ a.f[0]*b.f[0], a.f[1]*b.f[1], a.f[2]*b.f[2], a.f[3]*b.f[3] }}; return r; }
+static inline v4 v4_div(v4 a, v4 b)               { v4 r = {{ a.f[0]/b.f[0], a.f[1]/b.f[1], a.f[2]/b.f[2], a.f[3]/b.f[3] }}; return r; }
+typedef struct { int i[4]; } v4i;
+static inline v4i v4_round_int(v4 a)              { v4i r = {{ lrintf(a.f[0]), lrintf(a.f[1]), lrintf(a.f[2]), lrintf(a.f[3]) }}; return r; }
+static inline v4i v4i_and(v4i a, int mask)        { v4i r = {{ a.i[0]&mask, a.i[1]&mask, a.i[2]&mask, a.i[3]&mask }}; return r; }
+static inline v4 v4_from_int(v4i a)               { v4 r = {{ a.i[0], a.i[1], a.i[2], a.i[3] }}; return r; }
+#endif
+
+const char *mat4_simd_path()
+{
+    return MAT4_SIMD_PATH;
+}
+
+/* sin and cos of four angles at once. The angle is reduced by the nearest
+ * multiple of pi/2 (split in two for precision), the cephes minimax polynomials
+ * cover the remaining [-pi/4, pi/4] and the quadrant's low bits swap and negate
+ * the results arithmetically so no lane masks are needed */
+static void v4_sincos(v4 x, v4 *sin_out, v4 *cos_out)
+{
+    const v4    ONE = v4_splat(1);
+    v4i         quadrant = v4_round_int(v4_mul(x, v4_splat(0.636619772367581f)));
+    v4          q = v4_from_int(quadrant),
+                r, r2, s, c, odd, negate;
+
+    r  = v4_sub(x, v4_mul(q, v4_splat(1.57079625129699707031f)));
+    r  = v4_sub(r, v4_mul(q, v4_splat(7.54978995489188216e-8f)));
+    r2 = v4_mul(r, r);
+
+    s = v4_add(v4_mul(r2, v4_splat(-1.9515295891e-4f)), v4_splat(8.3321608736e-3f));
+    s = v4_add(v4_mul(r2, s), v4_splat(-1.6666654611e-1f));
+    s = v4_add(r, v4_mul(v4_mul(r2, r), s));
+
+    c = v4_add(v4_mul(r2, v4_splat(2.443315711809948e-5f)), v4_splat(-1.388731625493765e-3f));
+    c = v4_add(v4_mul(r2, c), v4_splat(4.166664568298827e-2f));
+    c = v4_add(v4_sub(ONE, v4_mul(r2, v4_splat(0.5f))), v4_mul(v4_mul(r2, r2), c));
+
+    odd    = v4_from_int(v4i_and(quadrant, 1));
+    negate = v4_sub(ONE, v4_from_int(v4i_and(quadrant, 2)));
+    *sin_out = v4_mul(v4_add(v4_mul(v4_sub(ONE, odd), s), v4_mul(odd, c)), negate);
+    *cos_out = v4_mul(v4_sub(v4_mul(v4_sub(ONE, odd), c), v4_mul(odd, s)), negate);
+}
+
 vec3 mat3_to_euler(mat4 mat3)
 {
     vec3 result = {0, asin(-mat3.m[2][0]), 0};
@@ -84,28 +167,40 @@ mat4 mat4_rotz(float rad)
     return result;
 }
 
+/* Each result row is a's row weighing the rows of b */
+void mat4_mult_ptr(const mat4 *a, const mat4 *b, mat4 *result)
+{
+    const v4    B0 = v4_load(b->m[0]),
+                B1 = v4_load(b->m[1]),
+                B2 = v4_load(b->m[2]),
+                B3 = v4_load(b->m[3]);
+    v4          rows[4];
+    int         row;
+
+    for (row = 0; row < 4; row++) {
+        rows[row] = v4_mul(v4_splat(a->m[row][0]), B0);
+        rows[row] = v4_add(rows[row], v4_mul(v4_splat(a->m[row][1]), B1));
+        rows[row] = v4_add(rows[row], v4_mul(v4_splat(a->m[row][2]), B2));
+        rows[row] = v4_add(rows[row], v4_mul(v4_splat(a->m[row][3]), B3));
+    }
+    for (row = 0; row < 4; row++)
+        v4_store(result->m[row], rows[row]);
+}
 mat4 mat4_mult(mat4 a, mat4 b) 
 {
     mat4 result;
-    int col, row, k;
-
-    for (row = 0; row < 4; ++row) {
-        for (col = 0; col < 4; ++col) {
-            result.m[row][col] = 0.0f;
-            for (k = 0; k < 4; ++k) {
-                result.m[row][col] += a.m[row][k] * b.m[k][col];
-            }
-        }
-    }
+    mat4_mult_ptr(&a, &b, &result);
     return result;
 }
 
+/* Gauss-Jordan with partial pivoting, every row operation covers a whole row at once */
 mat4 mat4_invert(mat4 mat)
 {
     mat4 result = MAT4_IDENTITY;
-    int pivot_row, pivot_col;
-    int row, col;
-    float temp, pivot, factor;
+    v4   pivot_mat, pivot_result, temp;
+    int  pivot_row, pivot_col;
+    int  row;
+    float pivot, factor;
 
     for (pivot_col = 0; pivot_col < 4; pivot_col++) {
         pivot_row = pivot_col;
@@ -115,16 +210,12 @@ mat4 mat4_invert(mat4 mat)
         }
 
         if (pivot_row != pivot_col) {
-            for (col = 0; col < 4; col++) {
-                temp = mat.m[pivot_col][col];
-                mat.m[pivot_col][col] = mat.m[pivot_row][col];
-                mat.m[pivot_row][col] = temp;
-            }
-            for (col = 0; col < 4; col++) {
-                temp = result.m[pivot_col][col];
-                result.m[pivot_col][col] = result.m[pivot_row][col];
-                result.m[pivot_row][col] = temp;
-            }
+            temp = v4_load(mat.m[pivot_col]);
+            v4_store(mat.m[pivot_col], v4_load(mat.m[pivot_row]));
+            v4_store(mat.m[pivot_row], temp);
+            temp = v4_load(result.m[pivot_col]);
+            v4_store(result.m[pivot_col], v4_load(result.m[pivot_row]));
+            v4_store(result.m[pivot_row], temp);
             pivot_row = pivot_col;
         }
 
@@ -134,43 +225,144 @@ mat4 mat4_invert(mat4 mat)
             return MAT4_IDENTITY;
         }
 
-        for (col = 0; col < 4; col++)
-            mat.m[pivot_row][col] /= pivot;
-        for (col = 0; col < 4; col++)
-            result.m[pivot_row][col] /= pivot;
+        pivot_mat    = v4_div(v4_load(mat.m[pivot_row]), v4_splat(pivot));
+        pivot_result = v4_div(v4_load(result.m[pivot_row]), v4_splat(pivot));
+        v4_store(mat.m[pivot_row], pivot_mat);
+        v4_store(result.m[pivot_row], pivot_result);
         
         for (row = 0; row < 4; row++ ) {
             if (row == pivot_row)
                 continue;
 
             factor = mat.m[row][pivot_col];
-            for (col = 0; col < 4; col++)
-                mat.m[row][col] -= factor * mat.m[pivot_row][col];
-            for (col = 0; col < 4; col++)
-                result.m[row][col] -= factor * result.m[pivot_row][col];
+            v4_store(mat.m[row], v4_sub(v4_load(mat.m[row]), v4_mul(v4_splat(factor), pivot_mat)));
+            v4_store(result.m[row], v4_sub(v4_load(result.m[row]), v4_mul(v4_splat(factor), pivot_result)));
         }
     }
 
     return result;
 }
 
+/* Affine matrices (last row 0 0 0 1) invert as [A^-1, -A^-1 t], A^-1 being the
+ * 3x3 adjugate over the determinant. Returns -1 and leaves result alone when
+ * A is singular, e.g. a zero scale somewhere along the hierarchy */
+int mat4_invert_affine(const mat4 *mat, mat4 *result)
+{
+    const float (*m)[4] = mat->m;
+    float cof00 = m[1][1]*m[2][2] - m[1][2]*m[2][1],
+          cof01 = m[1][2]*m[2][0] - m[1][0]*m[2][2],
+          cof02 = m[1][0]*m[2][1] - m[1][1]*m[2][0],
+          det, inv_det;
+    mat4  inv;
+
+    det = m[0][0]*cof00 + m[0][1]*cof01 + m[0][2]*cof02;
+    if (det == 0 || !isfinite(det))
+        return -1;
+    inv_det = 1 / det;
+
+    inv.m[0][0] = cof00 * inv_det;
+    inv.m[1][0] = cof01 * inv_det;
+    inv.m[2][0] = cof02 * inv_det;
+    inv.m[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) * inv_det;
+    inv.m[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) * inv_det;
+    inv.m[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) * inv_det;
+    inv.m[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) * inv_det;
+    inv.m[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) * inv_det;
+    inv.m[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) * inv_det;
+
+    inv.m[0][3] = -(inv.m[0][0]*m[0][3] + inv.m[0][1]*m[1][3] + inv.m[0][2]*m[2][3]);
+    inv.m[1][3] = -(inv.m[1][0]*m[0][3] + inv.m[1][1]*m[1][3] + inv.m[1][2]*m[2][3]);
+    inv.m[2][3] = -(inv.m[2][0]*m[0][3] + inv.m[2][1]*m[1][3] + inv.m[2][2]*m[2][3]);
+
+    inv.m[3][0] = 0; inv.m[3][1] = 0; inv.m[3][2] = 0; inv.m[3][3] = 1;
+    *result = inv;
+    return 0;
+}
+
 /* MATRIX UTILS */
+/* T * Rz * Ry * Rx * S built directly: the rotation rows are combined in closed
+ * form, scale weighs the columns and translation fills the last one */
 mat4 mat4_trs(struct transform transf)
 {
-    mat4 trs = mat4_scale(transf.scale);
-
-    if (transf.rot.x)
-        trs = mat4_mult(mat4_rotx(transf.rot.x), trs);
-    if (transf.rot.y)
-        trs = mat4_mult(mat4_roty(transf.rot.y), trs);
-    if (transf.rot.z)
-        trs = mat4_mult(mat4_rotz(transf.rot.z), trs);
-
-    if (transf.trans.x || transf.trans.y || transf.trans.z)
-        trs = mat4_mult(mat4_trans(transf.trans), trs);
+    const float cx = cos(transf.rot.x), sx = sin(transf.rot.x),
+                cy = cos(transf.rot.y), sy = sin(transf.rot.y),
+                cz = cos(transf.rot.z), sz = sin(transf.rot.z);
+    const float yx[3][4] = {
+        { cy, -sy*sx, -sy*cx, 0 },
+        { 0,   cx,    -sx,    0 },
+        { sy,  cy*sx,  cy*cx, 0 },
+    };
+    const float scale[4] = { transf.scale.x, transf.scale.y, transf.scale.z, 0 };
+    const v4    SCALE = v4_load(scale),
+                YX0 = v4_load(yx[0]),
+                YX1 = v4_load(yx[1]);
+    mat4        trs;
+
+    v4_store(trs.m[0], v4_mul(v4_sub(v4_mul(v4_splat(cz), YX0), v4_mul(v4_splat(sz), YX1)), SCALE));
+    v4_store(trs.m[1], v4_mul(v4_add(v4_mul(v4_splat(sz), YX0), v4_mul(v4_splat(cz), YX1)), SCALE));
+    v4_store(trs.m[2], v4_mul(v4_load(yx[2]), SCALE));
+    v4_store(trs.m[3], v4_load(MAT4_IDENTITY.m[3]));
+    trs.m[0][3] = transf.trans.x;
+    trs.m[1][3] = transf.trans.y;
+    trs.m[2][3] = transf.trans.z;
 
     return trs;
 }
+/* mat4_trs over four transforms per step, each element of the matrix is a
+ * row of lanes that gets scattered into the four outputs at the end */
+void mat4_trs_batch(const struct transform_soa *soa, size_t len, mat4 *out)
+{
+    float       lanes[12][4], tail[9][4];
+    v4          cx, sx, cy, sy, cz, sz,
+                scale_x, scale_y, scale_z;
+    size_t      i, count;
+    int         lane, elem;
+    const float *src[9];
+
+    for (i = 0; i < len; i += 4) {
+        count = len - i < 4 ? len - i : 4;
+
+        src[0] = soa->rot_x + i;    src[1] = soa->rot_y + i;    src[2] = soa->rot_z + i;
+        src[3] = soa->scale_x + i;  src[4] = soa->scale_y + i;  src[5] = soa->scale_z + i;
+        src[6] = soa->trans_x + i;  src[7] = soa->trans_y + i;  src[8] = soa->trans_z + i;
+        if (count < 4) {
+            for (elem = 0; elem < 9; elem++) {
+                for (lane = 0; lane < 4; lane++)
+                    tail[elem][lane] = lane < count ? src[elem][lane] : 0;
+                src[elem] = tail[elem];
+            }
+        }
+
+        v4_sincos(v4_load(src[0]), &sx, &cx);
+        v4_sincos(v4_load(src[1]), &sy, &cy);
+        v4_sincos(v4_load(src[2]), &sz, &cz);
+        scale_x = v4_load(src[3]);
+        scale_y = v4_load(src[4]);
+        scale_z = v4_load(src[5]);
+
+        /* rows of Rz * Ry * Rx * S, same terms as mat4_trs */
+        v4_store(lanes[0],  v4_mul(v4_mul(cz, cy), scale_x));
+        v4_store(lanes[1],  v4_mul(v4_sub(v4_mul(cz, v4_mul(v4_sub(v4_splat(0), sy), sx)), v4_mul(sz, cx)), scale_y));
+        v4_store(lanes[2],  v4_mul(v4_add(v4_mul(cz, v4_mul(v4_sub(v4_splat(0), sy), cx)), v4_mul(sz, sx)), scale_z));
+        v4_store(lanes[3],  v4_mul(v4_mul(sz, cy), scale_x));
+        v4_store(lanes[4],  v4_mul(v4_add(v4_mul(sz, v4_mul(v4_sub(v4_splat(0), sy), sx)), v4_mul(cz, cx)), scale_y));
+        v4_store(lanes[5],  v4_mul(v4_sub(v4_mul(sz, v4_mul(v4_sub(v4_splat(0), sy), cx)), v4_mul(cz, sx)), scale_z));
+        v4_store(lanes[6],  v4_mul(sy, scale_x));
+        v4_store(lanes[7],  v4_mul(v4_mul(cy, sx), scale_y));
+        v4_store(lanes[8],  v4_mul(v4_mul(cy, cx), scale_z));
+        v4_store(lanes[9],  v4_load(src[6]));
+        v4_store(lanes[10], v4_load(src[7]));
+        v4_store(lanes[11], v4_load(src[8]));
+
+        for (lane = 0; lane < count; lane++) {
+            mat4 *trs = out + i + lane;
+            trs->m[0][0] = lanes[0][lane]; trs->m[0][1] = lanes[1][lane]; trs->m[0][2] = lanes[2][lane]; trs->m[0][3] = lanes[9][lane];
+            trs->m[1][0] = lanes[3][lane]; trs->m[1][1] = lanes[4][lane]; trs->m[1][2] = lanes[5][lane]; trs->m[1][3] = lanes[10][lane];
+            trs->m[2][0] = lanes[6][lane]; trs->m[2][1] = lanes[7][lane]; trs->m[2][2] = lanes[8][lane]; trs->m[2][3] = lanes[11][lane];
+            trs->m[3][0] = 0;              trs->m[3][1] = 0;              trs->m[3][2] = 0;              trs->m[3][3] = 1;
+        }
+    }
+}
 mat4 mat4_perspective(float fov_y, float aspect, float near)
 {
     float f = 1/tan(fov_y/2);
@@ -255,7 +447,12 @@ struct transform transform_from_mat4(mat4 mat)
 }
 struct transform transform_relative(const struct transform *parent, const struct transform *subject)
 {
-    return transform_from_mat4( mat4_mult(mat4_invert(mat4_trs(*parent)), mat4_trs(*subject)) );
+    mat4 parent_inv = MAT4_IDENTITY,
+         parent_trs = mat4_trs(*parent);
+
+    if (mat4_invert_affine(&parent_trs, &parent_inv) != 0)
+        cuno_logf(LOG_WARN, "MATH: parent transform has a zero scale, not invertible!");
+    return transform_from_mat4( mat4_mult(parent_inv, mat4_trs(*subject)) );
 }
 
 
@@ -1,5 +1,6 @@
 #ifndef MATH_H
 #define MATH_H
+#include <stddef.h>
 
 #define PI 3.141592653589793
 #define DEG_TO_RAD(deg) (deg * PI/180)
@@ -26,6 +27,13 @@ struct transform {
 
 static const struct transform TRANSFORM_ZERO = {0};
 
+/* Transforms split into one array per component, for mat4_trs_batch */
+struct transform_soa {
+    float  *trans_x, *trans_y, *trans_z,
+           *rot_x, *rot_y, *rot_z,
+           *scale_x, *scale_y, *scale_z;
+};
+
 /* VECTORS */
 static inline vec2 vec2_create(float x, float y)
 { 
@@ -124,10 +132,14 @@ mat4 mat4_rotx(float rad);
 mat4 mat4_roty(float rad);
 mat4 mat4_rotz(float rad);
 mat4 mat4_mult(mat4 a, mat4 b); /* Chains nicely at the cost of copying mat4s */
+void mat4_mult_ptr(const mat4 *a, const mat4 *b, mat4 *result);
 mat4 mat4_invert(mat4 mat);
+int mat4_invert_affine(const mat4 *mat, mat4 *result); /* For mat4_trs products, -1 when singular */
 mat4 mat4_trs(struct transform transf);
+void mat4_trs_batch(const struct transform_soa *soa, size_t len, mat4 *out);
 mat4 mat4_perspective(float fov_y, float aspect, float near);
 mat4 mat4_orthographic(float width, float height, float far);
+const char *mat4_simd_path(); /* "sse2", "neon" or "scalar" */
 
 /* RECT2D */
 typedef struct {
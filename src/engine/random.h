@@ -0,0 +1,45 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+#include <stdint.h>
+
+/* PCG32 (XSH-RR), 16 bytes of state: seeded per owner, no hidden globals */
+struct rng {
+    uint64_t state;
+    uint64_t inc;
+};
+
+static inline uint32_t rng_next(struct rng *rng);
+
+static inline void rng_seed(struct rng *rng, uint64_t seed, uint64_t stream)
+{
+    rng->state = 0;
+    rng->inc   = (stream << 1) | 1;
+    rng_next(rng);
+    rng->state += seed;
+    rng_next(rng);
+}
+
+static inline uint32_t rng_next(struct rng *rng)
+{
+    uint64_t old = rng->state;
+    uint32_t xorshifted, rot;
+
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+    xorshifted = ((old >> 18) ^ old) >> 27;
+    rot        = old >> 59;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+static inline uint64_t rng_next64(struct rng *rng)
+{
+    uint64_t hi = rng_next(rng);
+    return hi << 32 | rng_next(rng);
+}
+
+/* [0, bound) by multiply-shift, the bias is below 2^-32 * bound */
+static inline uint32_t rng_range(struct rng *rng, uint32_t bound)
+{
+    return (uint32_t)(((uint64_t)rng_next(rng) * bound) >> 32);
+}
+
+#endif
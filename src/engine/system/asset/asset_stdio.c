@@ -1,11 +1,40 @@
+#include <stdio.h>
 #include "engine/system/asset.h"
+#include "engine/system/log.h"
+#include "engine/system/asset/asset_stdio.h"
+
+static const char *root = "assets";
+
+void asset_management_init(const char *root_dir)
+{
+    root = root_dir;
+}
 
 asset_handle asset_open(const char *asset_path) 
 {
-    return NULL;
+    char  path[512];
+    FILE *file;
+
+    if (snprintf(path, sizeof(path), "%s/%s", root, asset_path) >= (int)sizeof(path)) {
+        cuno_logf(LOG_ERR, "ASSET: Path to \"%s\" is too long", asset_path);
+        return NULL;
+    }
+    file = fopen(path, "rb");
+    if (!file)
+        cuno_logf(LOG_ERR, "ASSET: Failed to open resource \"%s\"", path);
+    return file;
+}
+void asset_close(asset_handle asset)
+{
+    if (asset)
+        fclose(asset);
 }
-void asset_close(asset_handle asset) { }
 int asset_read(void *buffer, size_t len, asset_handle asset)
 {
-    return -1;
+    size_t read_len;
+
+    if (!asset)
+        return -1;
+    read_len = fread(buffer, 1, len, asset);
+    return ferror((FILE *)asset) ? -1 : (int)read_len;
 }
@@ -0,0 +1,7 @@
+#ifndef ASSET_STDIO_H
+#define ASSET_STDIO_H
+
+/* Assets are read from files under root_dir, "assets" until this is called */
+void asset_management_init(const char *root_dir);
+
+#endif
@@ -31,6 +31,10 @@ struct graphic_session *graphic_session_create();
 int graphic_session_destroy(struct graphic_session *session);
 struct graphic_session_info graphic_session_info_get(struct graphic_session *session);
 int graphic_session_reset_window(struct graphic_session *session, void *native_window_handle);
+/* A session drawing into a width x height offscreen buffer, it's current
+ * and ready on return. graphic_render waits for the frame instead of presenting */
+struct graphic_session *graphic_session_create_offscreen(int width, int height);
+int graphic_session_dump_frame(struct graphic_session *session, const char *ppm_path);
 
 struct graphic_texture *graphic_texture_create(int width, int height, const unsigned char *bitmap, char is_mask);
 void graphic_texture_destroy(struct graphic_texture *texture);
@@ -38,6 +42,11 @@ void graphic_texture_destroy(struct graphic_texture *texture);
 struct graphic_vertecies *graphic_vertecies_create(const float *verts, size_t vert_count);
 void graphic_vertecies_destroy(struct graphic_vertecies *ctx);
 void graphic_draw(struct graphic_vertecies *ctx, struct graphic_texture *tex, mat4 mvp, vec3 color);
+/* Queues a draw, queued draws sharing a texture go out as one draw call on
+ * the next flush. Order only holds within the same texture, flush between
+ * passes that have to layer over each other */
+void graphic_batch_draw(struct graphic_vertecies *ctx, struct graphic_texture *tex, const mat4 *mvp, vec3 color);
+void graphic_batch_flush();
 void graphic_clear(float r, float g, float b);
 void graphic_render(struct graphic_session *session);
 
@@ -1,19 +1,24 @@
 #include <GLES2/gl2.h>
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "engine/system/graphic.h"
 #include "engine/system/graphic/glutil.h"
 #include "engine/system/graphic/glres.h"
 #include "engine/system/log.h"
+#include "engine/array_list.h"
 #include "engine/math.h"
 
+/* An offscreen session renders into a pbuffer instead of a native window */
 struct graphic_session {
     EGLDisplay  display;
     EGLConfig   config;
     EGLContext  context;
     EGLSurface  surface;
     void       *natwin;
+    char        offscreen;
 };
 
 static const EGLint dpy_required_attr[] = {
@@ -23,11 +28,23 @@ static const EGLint dpy_required_attr[] = {
     EGL_NONE
 };
 
+static const EGLint offscreen_required_attr[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 16,
+    EGL_NONE
+};
+
 static const EGLint ctx_required_attr[] = {
     EGL_CONTEXT_CLIENT_VERSION, 2,
     EGL_NONE
 };
 
+static void on_graphic_ready();
+
 static const char* egl_err_to_str(EGLint err)
 {
     switch (err) {
@@ -71,6 +88,70 @@ err:
     return NULL;
 }
 
+/* Prefers Mesa's surfaceless platform, so no display server is needed */
+static EGLDisplay offscreen_display_get()
+{
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+    EGLDisplay display;
+
+    get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display) {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        if (display != EGL_NO_DISPLAY)
+            return display;
+    }
+#endif
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+struct graphic_session *graphic_session_create_offscreen(int width, int height)
+{
+    const EGLint pbuffer_attr[] = {
+        EGL_WIDTH, width,
+        EGL_HEIGHT, height,
+        EGL_NONE
+    };
+    EGLint num_config;
+    struct graphic_session *session = malloc(sizeof(struct graphic_session));
+    if (!session)
+        return NULL;
+    memset(session, 0, sizeof(struct graphic_session));
+    session->offscreen = 1;
+
+    session->display = offscreen_display_get();
+    if (session->display == EGL_NO_DISPLAY)
+        goto err;
+
+    if (eglInitialize(session->display, NULL, NULL) != EGL_TRUE)
+        goto err;
+
+    if (eglChooseConfig(session->display, offscreen_required_attr, &session->config, 1, &num_config) != EGL_TRUE || num_config < 1)
+        goto err;
+
+    session->surface = eglCreatePbufferSurface(session->display, session->config, pbuffer_attr);
+    if (session->surface == EGL_NO_SURFACE)
+        goto err;
+
+    eglBindAPI(EGL_OPENGL_ES_API);
+    session->context = eglCreateContext(session->display, session->config, EGL_NO_CONTEXT, ctx_required_attr);
+    if (session->context == EGL_NO_CONTEXT)
+        goto err;
+
+    if (eglMakeCurrent(session->display, session->surface, session->surface, session->context) == EGL_FALSE)
+        goto err;
+
+    glViewport(0, 0, width, height);
+    on_graphic_ready();
+    return session;
+
+err:
+    cuno_logf(LOG_ERR, "GRAPHIC forwarded from EGL: %s", egl_err_to_str(eglGetError()));
+    if (session->display != EGL_NO_DISPLAY)
+        eglTerminate(session->display);
+    free(session);
+    return NULL;
+}
+
 int graphic_session_destroy(struct graphic_session *session)
 {
     eglMakeCurrent(session->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
@@ -81,9 +162,10 @@ int graphic_session_destroy(struct graphic_session *session)
     return 0;
 }
 
-static void on_graphic_ready();
 int graphic_session_reset_window(struct graphic_session *session, void *native_window_handle)
 {
+    if (session->offscreen)
+        return 0;
     session->natwin = native_window_handle;
 
     eglMakeCurrent(session->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
@@ -122,17 +204,55 @@ void graphic_clear(GLfloat r, GLfloat g, GLfloat b)
         cuno_logf(LOG_ERR, "GRAPHIC: context or suface is missing");
     glClearColor(r, g, b, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glFlush();
 }
 
 void graphic_render(struct graphic_session *session)
 {
     if (eglGetCurrentSurface(EGL_DRAW) == EGL_NO_SURFACE)
         cuno_logf(LOG_ERR, "GRAPHIC: No surface");
+    /* Nothing to present, waiting makes the frame's cost measurable */
+    if (session->offscreen) {
+        glFinish();
+        return;
+    }
     if (!eglSwapBuffers(session->display, session->surface))
         cuno_logf(LOG_ERR, "GRAPHIC: Post-Swap error: 0x%04x",  eglGetError());
 }
 
+int graphic_session_dump_frame(struct graphic_session *session, const char *ppm_path)
+{
+    struct graphic_session_info info = graphic_session_info_get(session);
+    unsigned char *pixels;
+    FILE *file;
+    int row, col, res = 0;
+
+    pixels = malloc((size_t)info.width * info.height * 4);
+    if (!pixels)
+        return -1;
+    glReadPixels(0, 0, info.width, info.height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+
+    file = fopen(ppm_path, "wb");
+    if (!file) {
+        cuno_logf(LOG_ERR, "GRAPHIC: Failed to open \"%s\" for the frame dump", ppm_path);
+        free(pixels);
+        return -1;
+    }
+
+    /* GL rows start at the bottom, PPM rows at the top */
+    fprintf(file, "P6\n%d %d\n255\n", info.width, info.height);
+    for (row = info.height - 1; row >= 0 && res == 0; row--)
+        for (col = 0; col < info.width; col++)
+            if (fwrite(pixels + ((size_t)row * info.width + col) * 4, 1, 3, file) != 3) {
+                res = -1;
+                break;
+            }
+
+    if (fclose(file) != 0)
+        res = -1;
+    free(pixels);
+    return res;
+}
+
 static GLuint default_program;
 static GLuint default_aPos;
 static GLuint default_aTexCoord;
@@ -140,33 +260,43 @@ static GLuint default_uMVP;
 static GLuint default_uFragMode;
 static GLuint default_uTexture;
 static GLuint default_uColorSolid;
+
+static GLuint batch_program;
+static GLuint batch_aClipPos;
+static GLuint batch_aTexCoord;
+static GLuint batch_aColor;
+static GLuint batch_uFragMode;
+static GLuint batch_uTexture;
+static GLuint batch_glvbo;
+
+static GLuint used_program;
+static void use_program(GLuint program)
+{
+    if (used_program == program)
+        return;
+    glUseProgram(program);
+    used_program = program;
+}
 static void create_program()
 {
-    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, VERTEX_SHADER_SRC);
-    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, FRAGMENT_SHADER_SRC);
-
-    GLuint default_program = glCreateProgram();
-    glAttachShader(default_program, vertex_shader);
-    glAttachShader(default_program, fragment_shader);
-    glLinkProgram(default_program);
-
-    GLint linked;
-    glGetProgramiv(default_program, GL_LINK_STATUS, &linked);
-    if (!linked) {
-        char log[512];
-        glGetProgramInfoLog(default_program, sizeof(log), NULL, log);
-        cuno_logf(LOG_ERR, "GRAPHIC: Shader compile error: %s", log);
-    }
-
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment_shader);
+    default_program     = link_program(VERTEX_SHADER_SRC, FRAGMENT_SHADER_SRC);
     default_aPos        = glGetAttribLocation(default_program, "aPosition");
     default_aTexCoord   = glGetAttribLocation(default_program, "aTexCoord");
     default_uMVP        = glGetUniformLocation(default_program, "uMVP");
     default_uFragMode   = glGetUniformLocation(default_program, "uFragMode");
     default_uTexture    = glGetUniformLocation(default_program, "uTexture");
     default_uColorSolid = glGetUniformLocation(default_program, "uColorSolid");
-    glUseProgram(default_program);
+
+    batch_program       = link_program(VERTEX_SHADER_BATCH_SRC, FRAGMENT_SHADER_BATCH_SRC);
+    batch_aClipPos      = glGetAttribLocation(batch_program, "aClipPosition");
+    batch_aTexCoord     = glGetAttribLocation(batch_program, "aTexCoord");
+    batch_aColor        = glGetAttribLocation(batch_program, "aColor");
+    batch_uFragMode     = glGetUniformLocation(batch_program, "uFragMode");
+    batch_uTexture      = glGetUniformLocation(batch_program, "uTexture");
+    glGenBuffers(1, &batch_glvbo);
+
+    used_program = 0;
+    use_program(default_program);
 
     glEnable(GL_DEPTH_TEST);
     
@@ -209,9 +339,11 @@ void graphic_texture_destroy(struct graphic_texture *texture)
     free(texture);
 }
 
+/* verts keeps a copy for batching, which transforms them on the cpu */
 struct graphic_vertecies {
     GLuint                  glvbo;
     size_t                  vert_count;
+    float                  *verts;
 };
 struct graphic_vertecies *graphic_vertecies_create(const float *verts, size_t vert_count)
 {
@@ -220,6 +352,12 @@ struct graphic_vertecies *graphic_vertecies_create(const float *verts, size_t ve
         return NULL;
 
     vertecies->vert_count = vert_count;
+    vertecies->verts = malloc(VERT_SIZE_BYTES*vert_count);
+    if (!vertecies->verts) {
+        free(vertecies);
+        return NULL;
+    }
+    memcpy(vertecies->verts, verts, VERT_SIZE_BYTES*vert_count);
 
     glGenBuffers(1, &vertecies->glvbo);
     glBindBuffer(GL_ARRAY_BUFFER, vertecies->glvbo);
@@ -231,16 +369,22 @@ struct graphic_vertecies *graphic_vertecies_create(const float *verts, size_t ve
 void graphic_vertecies_destroy(struct graphic_vertecies *vertecies)
 {
     glDeleteBuffers(1, &vertecies->glvbo);
+    free(vertecies->verts);
     free(vertecies);
 }
 
 static GLuint bound_vbo = -1;
 static GLuint bound_tex2D = -1;
+static int texture_frag_mode(const struct graphic_texture *texture)
+{
+    return texture != NULL ? ( texture->is_mask ? FRAG_MODE_TEXTURE_MASK : FRAG_MODE_TEXTURE) : FRAG_MODE_COLOR;
+}
 void graphic_draw(struct graphic_vertecies *vertecies, struct graphic_texture *texture, mat4 mvp, vec3 color)
 {
     if (!vertecies)
         return;
 
+    use_program(default_program);
     if (bound_vbo != vertecies->glvbo) {
         glBindBuffer(GL_ARRAY_BUFFER, vertecies->glvbo);
         bound_vbo = vertecies->glvbo;
@@ -261,12 +405,153 @@ void graphic_draw(struct graphic_vertecies *vertecies, struct graphic_texture *t
         glUniform1i(default_uTexture, 0);
     }
 
-    glUniform1i(default_uFragMode, texture != NULL ? ( texture->is_mask ? FRAG_MODE_TEXTURE_MASK : FRAG_MODE_TEXTURE) : FRAG_MODE_COLOR);
+    glUniform1i(default_uFragMode, texture_frag_mode(texture));
     glUniform3f(default_uColorSolid, color.x, color.y, color.z);
     glUniformMatrix4fv(default_uMVP, 1, GL_TRUE, mvp.m[0]);
 
     glDrawArrays(GL_TRIANGLES, 0, vertecies->vert_count);
-    glFlush();
+}
+
+/* BATCH */
+/* Queued draws are grouped by texture and frag mode, the only state the
+ * batch program has left, and merged into one stream buffer per flush. Each
+ * group is a single glDrawArrays over its slice of the buffer */
+#define BATCH_VERT_ELEM_COUNT   9   /* { clip x, y, z, w, tex_x, tex_y, r, g, b } */
+#define BATCH_MAX_GROUPS        32
+
+struct batch_draw {
+    struct graphic_vertecies   *vertecies;
+    mat4                        mvp;
+    vec3                        color;
+    int                         group;
+};
+struct batch_group {
+    struct graphic_texture     *texture;
+    size_t                      first_vert,
+                                vert_count;
+};
+DEFINE_ARRAY_LIST_WRAPPER(static, struct batch_draw, batch_draw_list)
+static struct batch_draw_list   batch_draws;
+static struct batch_group       batch_groups[BATCH_MAX_GROUPS];
+static int                      batch_groups_len;
+static float                   *batch_verts;
+static size_t                   batch_verts_allocated_len;
+
+void graphic_batch_draw(struct graphic_vertecies *vertecies, struct graphic_texture *texture, const mat4 *mvp, vec3 color)
+{
+    struct batch_draw *draw;
+    int group;
+
+    if (!vertecies || !vertecies->vert_count)
+        return;
+
+    for (group = 0; group < batch_groups_len; group++)
+        if (batch_groups[group].texture == texture)
+            break;
+    if (group == batch_groups_len) {
+        if (batch_groups_len == BATCH_MAX_GROUPS) {
+            graphic_batch_flush();
+            group = 0;
+        }
+        batch_groups[group].texture    = texture;
+        batch_groups[group].vert_count = 0;
+        batch_groups_len = group + 1;
+    }
+
+    draw = batch_draw_list_emplace(&batch_draws, 1);
+    draw->vertecies = vertecies;
+    draw->mvp       = *mvp;
+    draw->color     = color;
+    draw->group     = group;
+    batch_groups[group].vert_count += vertecies->vert_count;
+}
+static void batch_write_verts(float *out, const struct batch_draw *draw)
+{
+    const float *in = draw->vertecies->verts;
+    const mat4  *m  = &draw->mvp;
+    size_t i;
+    int row;
+
+    for (i = 0; i < draw->vertecies->vert_count; i++) {
+        for (row = 0; row < 4; row++)
+            out[row] = m->m[row][0]*in[0] + m->m[row][1]*in[1] + m->m[row][2]*in[2] + m->m[row][3];
+        out[4] = in[3];
+        out[5] = in[4];
+        out[6] = draw->color.x;
+        out[7] = draw->color.y;
+        out[8] = draw->color.z;
+
+        in  += VERT_ELEM_COUNT;
+        out += BATCH_VERT_ELEM_COUNT;
+    }
+}
+void graphic_batch_flush()
+{
+    const size_t STRIDE = BATCH_VERT_ELEM_COUNT*sizeof(float);
+    size_t  cursor[BATCH_MAX_GROUPS];
+    size_t  total = 0, new_len, i;
+    float  *verts;
+    int     group;
+
+    if (!batch_draws.len)
+        return;
+
+    for (group = 0; group < batch_groups_len; group++) {
+        batch_groups[group].first_vert = total;
+        cursor[group] = total;
+        total += batch_groups[group].vert_count;
+    }
+    if (total > batch_verts_allocated_len) {
+        new_len = batch_verts_allocated_len ? batch_verts_allocated_len : 256;
+        while (new_len < total)
+            new_len *= 2;
+        verts = realloc(batch_verts, new_len * STRIDE);
+        if (!verts) {
+            cuno_logf(LOG_ERR, "GRAPHIC: Failed to grow the batch to %zu vertecies", total);
+            goto reset;
+        }
+        batch_verts = verts;
+        batch_verts_allocated_len = new_len;
+    }
+
+    for (i = 0; i < batch_draws.len; i++) {
+        group = batch_draws.elems[i].group;
+        batch_write_verts(batch_verts + cursor[group]*BATCH_VERT_ELEM_COUNT, batch_draws.elems + i);
+        cursor[group] += batch_draws.elems[i].vertecies->vert_count;
+    }
+
+    use_program(batch_program);
+    glBindBuffer(GL_ARRAY_BUFFER, batch_glvbo);
+    bound_vbo = batch_glvbo;
+    glBufferData(GL_ARRAY_BUFFER, total * STRIDE, batch_verts, GL_STREAM_DRAW);
+
+    glVertexAttribPointer(batch_aClipPos, 4, GL_FLOAT, GL_FALSE, STRIDE, (void*)0);
+    glEnableVertexAttribArray(batch_aClipPos);
+    glVertexAttribPointer(batch_aTexCoord, 2, GL_FLOAT, GL_FALSE, STRIDE, (void*)(4*sizeof(GLfloat)));
+    glEnableVertexAttribArray(batch_aTexCoord);
+    glVertexAttribPointer(batch_aColor, 3, GL_FLOAT, GL_FALSE, STRIDE, (void*)(6*sizeof(GLfloat)));
+    glEnableVertexAttribArray(batch_aColor);
+
+    for (group = 0; group < batch_groups_len; group++) {
+        if (batch_groups[group].texture) {
+            if (bound_tex2D != batch_groups[group].texture->gltex) {
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, batch_groups[group].texture->gltex);
+                bound_tex2D = batch_groups[group].texture->gltex;
+            }
+            glUniform1i(batch_uTexture, 0);
+        }
+        glUniform1i(batch_uFragMode, texture_frag_mode(batch_groups[group].texture));
+        glDrawArrays(GL_TRIANGLES, batch_groups[group].first_vert, batch_groups[group].vert_count);
+    }
+    /* graphic_draw sets up its own arrays again, it sees batch_glvbo bound */
+    glDisableVertexAttribArray(batch_aClipPos);
+    glDisableVertexAttribArray(batch_aTexCoord);
+    glDisableVertexAttribArray(batch_aColor);
+
+reset:
+    batch_draw_list_clear(&batch_draws);
+    batch_groups_len = 0;
 }
 
 /* Utils */
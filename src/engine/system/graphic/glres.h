@@ -34,3 +34,34 @@ static const char* FRAGMENT_SHADER_SRC =
     "       gl_FragColor = vec4(uColorSolid.x, uColorSolid.y, uColorSolid.z, 1);\n"
     "   \n"
     "}\n";
+
+/* Batched draws come in already transformed, with their color per vertex */
+static const char* VERTEX_SHADER_BATCH_SRC =
+    "attribute vec4 aClipPosition;\n"
+    "attribute vec2 aTexCoord;\n"
+    "attribute vec3 aColor;\n"
+    "varying vec2 vTexCoord;\n"
+    "varying vec3 vColor;\n"
+    "void main()\n"
+    "{\n"
+    "   gl_Position = aClipPosition;\n"
+    "   vTexCoord = aTexCoord;\n"
+    "   vColor = aColor;\n"
+    "}\n";
+
+static const char* FRAGMENT_SHADER_BATCH_SRC =
+    "precision mediump float;\n"
+    "uniform int uFragMode;\n"
+    "uniform sampler2D uTexture;\n"
+    "varying vec2 vTexCoord;\n"
+    "varying vec3 vColor;\n"
+    "void main()\n"
+    "{\n"
+    "   if (uFragMode == "STR(FRAG_MODE_TEXTURE)")\n"
+    "       gl_FragColor = texture2D(uTexture, vTexCoord);\n"
+    "   else if (uFragMode ==  "STR(FRAG_MODE_TEXTURE_MASK)")\n"
+    "       gl_FragColor = vec4(vColor, texture2D(uTexture, vTexCoord).a);\n"
+    "   else \n"
+    "       gl_FragColor = vec4(vColor, 1);\n"
+    "   \n"
+    "}\n";
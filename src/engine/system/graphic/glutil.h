@@ -16,3 +16,26 @@ static GLuint compile_shader(GLenum type, const char* source) {
 
     return shader;
 }
+
+static GLuint link_program(const char *vertex_src, const char *fragment_src)
+{
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_src);
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_src);
+    GLuint program = glCreateProgram();
+    GLint linked;
+
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (!linked) {
+        char log[512];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        cuno_logf(LOG_ERR, "GRAPHIC: Shader compile error: %s", log);
+    }
+
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    return program;
+}
@@ -9,6 +9,14 @@ struct graphic_session *graphic_session_create()
     struct graphic_session *session = malloc(sizeof(struct graphic_session));
     return session;
 }
+struct graphic_session *graphic_session_create_offscreen(int width, int height)
+{
+    return graphic_session_create();
+}
+int graphic_session_dump_frame(struct graphic_session *session, const char *ppm_path)
+{
+    return -1;
+}
 int graphic_session_destroy(struct graphic_session *session)
 {
     free(session);
@@ -50,5 +58,7 @@ void graphic_vertecies_destroy(struct graphic_vertecies *vertecies)
     free(vertecies);
 }
 void graphic_draw(struct graphic_vertecies *vertecies, struct graphic_texture *texture, mat4 mvp, vec3 color) { }
+void graphic_batch_draw(struct graphic_vertecies *vertecies, struct graphic_texture *texture, const mat4 *mvp, vec3 color) { }
+void graphic_batch_flush() { }
 void graphic_construct_3D_quad(float *verts, rect2D dimension, rect2D tex) { }
 
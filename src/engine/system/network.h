@@ -8,12 +8,16 @@
 #include "engine/utils.h"
 #include "engine/system/network_packer.h"
 
-#define NETWORK_POLLIN  1<<1
-#define NETWORK_POLLOUT 1<<2
+#define NETWORK_POLLIN  (1<<1)
+#define NETWORK_POLLOUT (1<<2)
+
+/* Buffers grow on demand up to this, a peer needing more is treated as broken */
+#define NETWORK_BUFFER_MAX (1 << 20)
 
 #define NETWORK_BUFFER_LEN(buff) ((buff).tail - (buff).head)
 #define NETWORK_BUFFER_SPACE(buff) ((buff).end - (buff).tail)
 #define NETWORK_BUFFER_CAPACITY(buff) ((buff).end - (buff).start)
+#define NETWORK_SENDQ_LEN(queue) ((queue).len - (queue).head)
 
 enum network_result {
     NETRES_SUCCESS,
@@ -27,6 +31,11 @@ enum network_result {
 };
 struct network_connection;
 struct network_listener;
+struct network_poller;
+struct network_event {
+    void *userdata;
+    char  flags;
+};
 struct network_header {
     uint16_t version;
     uint16_t type;
@@ -38,6 +47,24 @@ struct network_buffer {
             *tail,
             *end;
 };
+/* Immutable once queued, shared between every connection that sends it */
+struct network_payload {
+    unsigned int refs;
+    size_t       len;
+    uint8_t      data[];
+};
+struct network_segment {
+    struct network_payload *payload;
+    size_t                  head,
+                            tail;
+};
+/* Segments go out in order through one scatter/gather call per flush */
+struct network_sendq {
+    struct network_segment *segs;
+    size_t                  head,
+                            len,
+                            capacity;
+};
 STATIC_ASSERT(CHAR_BIT == 8, unsupported_byte_width);
 STATIC_ASSERT(sizeof(struct network_header) == 8, net_header_size_mismatch);
 
@@ -54,18 +81,38 @@ char network_connection_poll(struct network_connection *conn, char flags);
 enum network_result network_connection_send(struct network_connection *conn, uint8_t **readcursor, const uint8_t *end);
 enum network_result network_connection_recv(struct network_connection *conn, uint8_t **writecursor, const uint8_t *end);
 
-void network_connection_sendrecv_nb(struct network_connection *conn, struct network_buffer *sendbuff, struct network_buffer *recvbuff);
+enum network_result network_connection_sendrecv(struct network_connection *conn, struct network_buffer *sendbuff, struct network_buffer *recvbuff, char ready);
+enum network_result network_connection_sendq(struct network_connection *conn, struct network_sendq *queue);
+enum network_result network_connection_sendrecv_nb(struct network_connection *conn, struct network_buffer *sendbuff, struct network_buffer *recvbuff);
 
 struct network_listener *network_listener_create(short port, int max_pending);
 void network_listener_destroy(struct network_listener *listener);
 int network_listener_poll(struct network_listener *listener);
 struct network_connection *network_listener_accept(struct network_listener *listener);
 
+/* Readiness backend: sockets are registered once, wait only reports the ready ones */
+struct network_poller *network_poller_create();
+void network_poller_destroy(struct network_poller *poller);
+int network_poller_add_listener(struct network_poller *poller, struct network_listener *listener, void *userdata);
+int network_poller_add_connection(struct network_poller *poller, struct network_connection *conn, char flags, void *userdata);
+int network_poller_modify_connection(struct network_poller *poller, struct network_connection *conn, char flags, void *userdata);
+int network_poller_watch_connection(struct network_poller *poller, struct network_connection *conn, char flags, void *userdata);
+int network_poller_remove_connection(struct network_poller *poller, struct network_connection *conn);
+int network_poller_wait(struct network_poller *poller, struct network_event *events, int max_events, int timeout_ms);
+
 void network_buffer_init(struct network_buffer *buff, size_t capacity);
 void network_buffer_deinit(struct network_buffer *buff);
 int network_buffer_make_space(struct network_buffer *buff, size_t space);
 int network_buffer_peek_hdrmsg(const struct network_buffer *buff);
 
+struct network_payload *network_payload_create(size_t len);
+void network_payload_retain(struct network_payload *payload);
+void network_payload_release(struct network_payload *payload);
+
+void network_sendq_init(struct network_sendq *queue, size_t capacity);
+void network_sendq_deinit(struct network_sendq *queue);
+int network_sendq_push(struct network_sendq *queue, struct network_payload *payload, size_t offset, size_t len);
+
 static inline const char *str_network_result(enum network_result res)
 {
     switch(res) {
@@ -1,25 +1,26 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/poll.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <errno.h>
+#include "engine/system/network/network_posix.h"
 #include "engine/system/network_packer.h"
 #include "engine/system/network.h"
 #include "engine/system/log.h"
 #include "engine/alias.h"
 
-struct network_connection {
-    int sockfd;
-};
-struct network_listener {
-    int sockfd;
-};
+#define NETWORK_IOV_MAX 64
 
 enum network_result netres_from_errno() 
 {
     switch(errno) {
         case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
             return NETRES_ERR_AGAIN;
         case ETIMEDOUT:
             return NETRES_ERR_TIMEDOUT;
@@ -32,6 +33,14 @@ enum network_result netres_from_errno()
     }
 }
 
+static int set_nonblocking(int sockfd)
+{
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+}
+
 u16 network_u16_to_host(u16 net) { return ntohs(net); }
 
 u32 network_u32_to_host(u32 net) { return ntohl(net); }
@@ -64,12 +73,32 @@ void network_buffer_compact(struct network_buffer *buff)
 
 int network_buffer_make_space(struct network_buffer *buff, size_t space)
 {
-    if (buff->tail + space < buff->end)
+    const size_t LEN = NETWORK_BUFFER_LEN(*buff);
+    size_t   capacity = NETWORK_BUFFER_CAPACITY(*buff);
+    uint8_t *start;
+
+    if (buff->tail + space <= buff->end)
         return 0;
-    if (NETWORK_BUFFER_LEN(*buff) + space > NETWORK_BUFFER_CAPACITY(*buff))
+    if (LEN + space <= capacity) {
+        network_buffer_compact(buff);
+        return 0;
+    }
+    if (LEN + space > NETWORK_BUFFER_MAX)
         return -1;
-    
+
+    while (capacity < LEN + space)
+        capacity = capacity ? capacity * 2 : 64;
+    capacity = min(capacity, NETWORK_BUFFER_MAX);
+
     network_buffer_compact(buff);
+    start = realloc(buff->start, capacity);
+    if (!start)
+        return -1;
+
+    buff->head  = start;
+    buff->tail  = start + LEN;
+    buff->start = start;
+    buff->end   = start + capacity;
     return 0;
 }
 
@@ -88,6 +117,71 @@ int network_buffer_peek_hdrmsg(const struct network_buffer *buff)
     return 1;
 }
 
+struct network_payload *network_payload_create(size_t len)
+{
+    struct network_payload *payload = malloc(sizeof(struct network_payload) + len);
+    if (!payload)
+        return NULL;
+
+    payload->refs = 1;
+    payload->len  = len;
+    return payload;
+}
+
+void network_payload_retain(struct network_payload *payload)
+{
+    payload->refs++;
+}
+
+void network_payload_release(struct network_payload *payload)
+{
+    if (--payload->refs == 0)
+        free(payload);
+}
+
+void network_sendq_init(struct network_sendq *queue, size_t capacity)
+{
+    queue->segs     = malloc(sizeof(struct network_segment) * capacity);
+    queue->head     = 0;
+    queue->len      = 0;
+    queue->capacity = queue->segs ? capacity : 0;
+}
+
+void network_sendq_deinit(struct network_sendq *queue)
+{
+    size_t i;
+    for (i = queue->head; i < queue->len; i++)
+        network_payload_release(queue->segs[i].payload);
+    free(queue->segs);
+}
+
+int network_sendq_push(struct network_sendq *queue, struct network_payload *payload, size_t offset, size_t len)
+{
+    struct network_segment *segs;
+    size_t capacity;
+
+    if (queue->len == queue->capacity && queue->head) {
+        memmove(queue->segs, queue->segs + queue->head, sizeof(struct network_segment) * NETWORK_SENDQ_LEN(*queue));
+        queue->len -= queue->head;
+        queue->head = 0;
+    }
+    if (queue->len == queue->capacity) {
+        capacity = queue->capacity ? queue->capacity * 2 : 8;
+        segs = realloc(queue->segs, sizeof(struct network_segment) * capacity);
+        if (!segs)
+            return -1;
+        queue->segs     = segs;
+        queue->capacity = capacity;
+    }
+
+    network_payload_retain(payload);
+    queue->segs[queue->len].payload = payload;
+    queue->segs[queue->len].head    = offset;
+    queue->segs[queue->len].tail    = offset + len;
+    queue->len++;
+    return 0;
+}
+
 
 struct network_connection *network_connection_create(const char* ipv4addr, short port)
 {
@@ -111,6 +205,7 @@ struct network_connection *network_connection_create(const char* ipv4addr, short
 
     memset(conn, 0, sizeof(struct network_connection));
     conn->sockfd = sockfd;
+    set_nonblocking(sockfd);
     cuno_logf(LOG_INFO, "Connected\n");
     return conn;
 err:
@@ -135,15 +230,15 @@ char network_connection_poll(struct network_connection *conn, char event)
 
     poll(&pollfd, 1, 0);
 
-    return (pollfd.revents & POLLIN)  ? NETWORK_POLLIN  : 0 | 
-           (pollfd.revents & POLLOUT) ? NETWORK_POLLOUT : 0;
+    return ((pollfd.revents & (POLLIN | POLLHUP | POLLERR)) ? NETWORK_POLLIN  : 0) | 
+           ((pollfd.revents & POLLOUT)                     ? NETWORK_POLLOUT : 0);
 }
 
 enum network_result network_connection_send(struct network_connection *conn, uint8_t **readcursor, const uint8_t *end)
 {
     ssize_t res;
 
-    res = send(conn->sockfd, *readcursor, end - *readcursor, 0);
+    res = send(conn->sockfd, *readcursor, end - *readcursor, MSG_NOSIGNAL);
     if (res < 0)
         return netres_from_errno();
 
@@ -167,31 +262,94 @@ enum network_result network_connection_recv(struct network_connection *conn, uin
     return NETRES_SUCCESS;
 }
 
-void network_connection_sendrecv_nb(struct network_connection *conn, struct network_buffer *sendbuff, struct network_buffer *recvbuff)
+enum network_result network_connection_sendrecv(struct network_connection *conn, struct network_buffer *sendbuff, struct network_buffer *recvbuff, char ready)
 {
-    char status;
+    enum network_result res = NETRES_SUCCESS;
 
     if (!conn)
-        return;
-
-    status = network_connection_poll(conn, NETWORK_POLLIN | NETWORK_POLLOUT);
+        return NETRES_ERR_CONN;
 
-    if ((status & NETWORK_POLLOUT) && NETWORK_BUFFER_LEN(*sendbuff))
-        network_connection_send(conn, &sendbuff->head, sendbuff->tail);
+    if ((ready & NETWORK_POLLOUT) && NETWORK_BUFFER_LEN(*sendbuff)) {
+        res = network_connection_send(conn, &sendbuff->head, sendbuff->tail);
+        if (res != NETRES_SUCCESS && res != NETRES_PARTIAL && res != NETRES_ERR_AGAIN)
+            return res;
+        res = NETRES_SUCCESS;
+    }
 
-    if (status & NETWORK_POLLIN) {
+    if (ready & NETWORK_POLLIN) {
         while (1) {
-            network_connection_recv(conn, &recvbuff->tail, recvbuff->end);
-            if (recvbuff->tail != recvbuff->end)
+            res = network_connection_recv(conn, &recvbuff->tail, recvbuff->end);
+            if (res != NETRES_SUCCESS || recvbuff->tail != recvbuff->end)
+                break;
+
+            /* A full buffer may hide more pending bytes, grow rather than leave them queued */
+            if (network_buffer_make_space(recvbuff, NETWORK_BUFFER_CAPACITY(*recvbuff) / 2 + 1) != 0) {
+                cuno_logf(LOG_WARN, "NETWORK: receive buffer exceeded %d bytes", NETWORK_BUFFER_MAX);
+                return NETRES_ERR;
+            }
+        }
+        if (res == NETRES_ERR_AGAIN)
+            res = NETRES_SUCCESS;
+    }
+    return res;
+}
+
+enum network_result network_connection_sendq(struct network_connection *conn, struct network_sendq *queue)
+{
+    struct iovec            iov[NETWORK_IOV_MAX];
+    struct msghdr           msg = {0};
+    struct network_segment *seg;
+    enum network_result     res;
+    ssize_t                 sent;
+    size_t                  i, iovlen;
+
+    if (!conn)
+        return NETRES_ERR_CONN;
+
+    while (NETWORK_SENDQ_LEN(*queue)) {
+        iovlen = min(NETWORK_SENDQ_LEN(*queue), NETWORK_IOV_MAX);
+        for (i = 0; i < iovlen; i++) {
+            seg = queue->segs + queue->head + i;
+            iov[i].iov_base = seg->payload->data + seg->head;
+            iov[i].iov_len  = seg->tail - seg->head;
+        }
+        msg.msg_iov     = iov;
+        msg.msg_iovlen  = iovlen;
+
+        sent = sendmsg(conn->sockfd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            res = netres_from_errno();
+            return res == NETRES_ERR_AGAIN ? NETRES_PARTIAL : res;
+        }
+
+        while (sent > 0) {
+            seg = queue->segs + queue->head;
+            if ((size_t)sent < seg->tail - seg->head) {
+                seg->head += sent;
                 break;
-            network_buffer_compact(recvbuff);
+            }
+            sent -= seg->tail - seg->head;
+            network_payload_release(seg->payload);
+            queue->head++;
         }
     }
+    queue->head = queue->len = 0;
+    return NETRES_SUCCESS;
+}
+
+enum network_result network_connection_sendrecv_nb(struct network_connection *conn, struct network_buffer *sendbuff, struct network_buffer *recvbuff)
+{
+    if (!conn)
+        return NETRES_ERR_CONN;
+
+    return network_connection_sendrecv(conn, sendbuff, recvbuff, 
+                                       network_connection_poll(conn, NETWORK_POLLIN | NETWORK_POLLOUT));
 }
 
 struct network_listener *network_listener_create(short port, int max_pending)
 {
-    int                     sockfd;
+    int                     sockfd,
+                            reuse = 1;
     struct sockaddr_in      sockaddr;
     struct network_listener *listener;
 
@@ -203,6 +361,8 @@ struct network_listener *network_listener_create(short port, int max_pending)
     sockaddr.sin_port        = htons(port);
     sockaddr.sin_addr.s_addr = INADDR_ANY;
 
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     if (bind(sockfd, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0)
         goto err;
 
@@ -210,7 +370,10 @@ struct network_listener *network_listener_create(short port, int max_pending)
         goto err;
 
     listener = malloc(sizeof(struct network_listener));
+    if (!listener)
+        goto err;
     listener->sockfd = sockfd;
+    set_nonblocking(sockfd);
 
     return listener;
 err:
@@ -229,10 +392,20 @@ int network_listener_poll(struct network_listener *listener)
 }
 struct network_connection *network_listener_accept(struct network_listener *listener)
 {
-    struct network_connection *conn = malloc(sizeof(struct network_connection));
-    if (!conn)
+    struct network_connection *conn;
+    int sockfd;
+
+    sockfd = accept(listener->sockfd, NULL, NULL);
+    if (sockfd == -1)
         return NULL;
 
-    conn->sockfd = accept(listener->sockfd, NULL, NULL);
+    conn = malloc(sizeof(struct network_connection));
+    if (!conn) {
+        close(sockfd);
+        return NULL;
+    }
+    memset(conn, 0, sizeof(struct network_connection));
+    conn->sockfd = sockfd;
+    set_nonblocking(sockfd);
     return conn;
 }
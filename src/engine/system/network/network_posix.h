@@ -0,0 +1,12 @@
+#ifndef NETWORK_POSIX_H
+#define NETWORK_POSIX_H
+
+struct network_connection {
+    int sockfd;
+    char watched;
+};
+struct network_listener {
+    int sockfd;
+};
+
+#endif
@@ -0,0 +1,122 @@
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "engine/system/network/network_posix.h"
+#include "engine/system/network.h"
+#include "engine/system/log.h"
+
+struct network_poller {
+    int                  epfd;
+    struct epoll_event  *events;
+    int                  events_len;
+};
+
+static uint32_t epoll_flags_from_network(char flags)
+{
+    return (flags & NETWORK_POLLIN  ? EPOLLIN  : 0) |
+           (flags & NETWORK_POLLOUT ? EPOLLOUT : 0);
+}
+
+static char network_flags_from_epoll(uint32_t events)
+{
+    /* Hangups and errors surface as readable so the following recv reports them */
+    return (events & (EPOLLIN | EPOLLHUP | EPOLLERR) ? NETWORK_POLLIN  : 0) |
+           (events & EPOLLOUT                        ? NETWORK_POLLOUT : 0);
+}
+
+struct network_poller *network_poller_create()
+{
+    struct network_poller *poller = malloc(sizeof(struct network_poller));
+    if (!poller)
+        return NULL;
+
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->epfd == -1) {
+        cuno_logf(LOG_ERR, "NETWORK: epoll_create1 failed: %s", strerror(errno));
+        free(poller);
+        return NULL;
+    }
+    poller->events     = NULL;
+    poller->events_len = 0;
+    return poller;
+}
+
+void network_poller_destroy(struct network_poller *poller)
+{
+    close(poller->epfd);
+    free(poller->events);
+    free(poller);
+}
+
+static int poller_ctl(struct network_poller *poller, int op, int fd, char flags, void *userdata)
+{
+    struct epoll_event event = { 0 };
+
+    event.events   = epoll_flags_from_network(flags);
+    event.data.ptr = userdata;
+    if (epoll_ctl(poller->epfd, op, fd, &event) == -1) {
+        cuno_logf(LOG_ERR, "NETWORK: epoll_ctl failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int network_poller_add_listener(struct network_poller *poller, struct network_listener *listener, void *userdata)
+{
+    return poller_ctl(poller, EPOLL_CTL_ADD, listener->sockfd, NETWORK_POLLIN, userdata);
+}
+
+int network_poller_add_connection(struct network_poller *poller, struct network_connection *conn, char flags, void *userdata)
+{
+    if (poller_ctl(poller, EPOLL_CTL_ADD, conn->sockfd, flags, userdata) != 0)
+        return -1;
+    conn->watched = flags;
+    return 0;
+}
+
+int network_poller_modify_connection(struct network_poller *poller, struct network_connection *conn, char flags, void *userdata)
+{
+    if (poller_ctl(poller, EPOLL_CTL_MOD, conn->sockfd, flags, userdata) != 0)
+        return -1;
+    conn->watched = flags;
+    return 0;
+}
+
+int network_poller_watch_connection(struct network_poller *poller, struct network_connection *conn, char flags, void *userdata)
+{
+    if (conn->watched == flags)
+        return 0;
+    return network_poller_modify_connection(poller, conn, flags, userdata);
+}
+
+int network_poller_remove_connection(struct network_poller *poller, struct network_connection *conn)
+{
+    if (epoll_ctl(poller->epfd, EPOLL_CTL_DEL, conn->sockfd, NULL) == -1)
+        return -1;
+    conn->watched = 0;
+    return 0;
+}
+
+int network_poller_wait(struct network_poller *poller, struct network_event *events, int max_events, int timeout_ms)
+{
+    int i, ready;
+
+    if (poller->events_len < max_events) {
+        free(poller->events);
+        poller->events     = malloc(sizeof(struct epoll_event) * max_events);
+        poller->events_len = poller->events ? max_events : 0;
+        if (!poller->events)
+            return -1;
+    }
+
+    do
+        ready = epoll_wait(poller->epfd, poller->events, max_events, timeout_ms);
+    while (ready == -1 && errno == EINTR);
+
+    for (i = 0; i < ready; i++) {
+        events[i].userdata = poller->events[i].data.ptr;
+        events[i].flags    = network_flags_from_epoll(poller->events[i].events);
+    }
+    return ready;
+}
@@ -68,6 +68,17 @@ static inline size_t network_pack_u32(uint8_t **cursor, uint32_t src)
     return sizeof(src);
 }
 
+static inline size_t network_pack_u64(uint8_t **cursor, uint64_t src)
+{
+    if ((cursor) == NULL)
+        return sizeof(src);
+
+    network_pack_u32(cursor, src >> 32);
+    network_pack_u32(cursor, src);
+
+    return sizeof(src);
+}
+
 static inline void network_unpack_str(const char* dst, uint8_t **cursor) 
 { 
      *cursor += sprintf((char *)dst, "%s", *cursor);
@@ -96,4 +107,10 @@ static inline uint32_t network_unpack_u32(uint8_t **cursor)
     return network_u32_to_host(temp);
 }
 
+static inline uint64_t network_unpack_u64(uint8_t **cursor)
+{
+    uint64_t high = network_unpack_u32(cursor);
+    return high << 32 | network_unpack_u32(cursor);
+}
+
 #endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include "engine/system/network.h"
 #include "engine/utils.h"
@@ -22,7 +23,11 @@ void print_spinner()
 static struct game_state     client_state = {0};
        char                  client_youvegotmail = 0;
 static int                   client_playerid = -1;
+static struct game_state_delta client_delta;
+static uint32_t              client_seq;
+static char                  client_desynced = 0;
 struct network_connection   *client_serverconn = NULL;
+struct network_poller       *client_poller = NULL;
 struct network_buffer        client_sendbuff, client_recvbuff;
 
 void client_handle_local_recv(short type, const void *data)
@@ -41,20 +46,53 @@ void client_handle_local_recv(short type, const void *data)
     }
 }
 
+void client_join_lobby()
+{
+    struct network_header header = {
+        .version = NETMSG_VER_MAX, /* the server answers in the highest version both sides know */
+        .type = MSG_LB_JOIN,
+        .len = 0
+    };
+    struct lobby_join join = { .seats = 0 };
+
+    header.len = lobby_join_serialize(NULL, join);
+    network_buffer_make_space(&client_sendbuff, header.len + NETHDR_SERIALIZED_SIZE);
+    network_header_serialize(&client_sendbuff.tail, &header);
+    lobby_join_serialize(&client_sendbuff.tail, join);
+}
+
+/* Deltas are ignored until the snapshot answering this arrives */
+void client_request_resync()
+{
+    struct network_header header = {
+        .version = NETMSG_VER,
+        .type = MSG_GM_RESYNC,
+        .len = 0
+    };
+
+    client_desynced = 1;
+    network_buffer_make_space(&client_sendbuff, NETHDR_SERIALIZED_SIZE);
+    network_header_serialize(&client_sendbuff.tail, &header);
+}
+
 void client_start(struct network_connection *conn)
 {
     client_serverconn = conn;
     network_buffer_init(&client_sendbuff, 128);
     network_buffer_init(&client_recvbuff, 2048);
     game_state_init(&client_state);
+    game_state_delta_init(&client_delta);
 
     if (!client_serverconn)
         server_register_local(&client_handle_local_recv);
+    else
+        client_join_lobby();
 }
 
 void client_process_recvbuff()
 {
     struct network_header header;
+    uint32_t seq;
 
     if (!network_buffer_peek_hdrmsg(&client_recvbuff))
         return;
@@ -66,17 +104,34 @@ void client_process_recvbuff()
             client_playerid = network_unpack_u8(&client_recvbuff.head);
             return;
         case MSG_GM_STATE:
-            game_state_deserialize(&client_state, &client_recvbuff.head);
+            client_seq = network_unpack_u32(&client_recvbuff.head);
+            game_state_deserialize(&client_state, &client_recvbuff.head, header.version);
+            game_state_private_deserialize(&client_state, &client_recvbuff.head, header.version);
+            client_desynced = 0;
+            client_youvegotmail = 1;
+            return;
+        case MSG_GM_DELTA:
+            seq = network_unpack_u32(&client_recvbuff.head);
+            game_state_delta_deserialize(&client_delta, &client_recvbuff.head, header.version);
+            game_state_delta_private_deserialize(&client_delta, &client_recvbuff.head, header.version);
+            if (client_desynced)
+                return;
+            if (seq != client_seq + 1 || game_state_apply_delta(&client_state, &client_delta) != 0) {
+                client_request_resync();
+                return;
+            }
+            client_seq = seq;
             client_youvegotmail = 1;
             return;
         default:
             printf("Client: unhandled MSG type %d\n", header.type);
+            client_recvbuff.head += header.len;
             return;
     }
 }
 void client_update_state()
 {
-    while (NETWORK_BUFFER_LEN(client_recvbuff))
+    while (network_buffer_peek_hdrmsg(&client_recvbuff))
         client_process_recvbuff();
 }
 
@@ -128,9 +183,23 @@ retry:
     }
 }
 
-void client_update()
+/* Waits on the server socket instead of sleeping, returns -1 once disconnected */
+int client_update()
 {
-    network_connection_sendrecv_nb(client_serverconn, &client_sendbuff, &client_recvbuff);
+    struct network_event event = {0};
+    char watch = NETWORK_POLLIN;
+
+    if (client_serverconn) {
+        if (NETWORK_BUFFER_LEN(client_sendbuff))
+            watch |= NETWORK_POLLOUT;
+        network_poller_watch_connection(client_poller, client_serverconn, watch, NULL);
+
+        if (network_poller_wait(client_poller, &event, 1, 100) > 0
+         && network_connection_sendrecv(client_serverconn, &client_sendbuff, &client_recvbuff, event.flags) >= NETRES_ERR_CONN) {
+            printf("Disconnected\n");
+            return -1;
+        }
+    }
 
     client_update_state(); 
     if (client_youvegotmail) {
@@ -142,12 +211,15 @@ void client_update()
 
         if (client_state.active_player_index == client_playerid) {
             client_act();
-            return;
+            return 0;
         }
         printf("Waiting for update... ");
     }
 
-    print_spinner(); usleep(100 * 1000);
+    print_spinner();
+    if (!client_serverconn)
+        usleep(100 * 1000);
+    return 0;
 }
 
 void main_client(const char *ipv4addr, short port)
@@ -159,11 +231,17 @@ void main_client(const char *ipv4addr, short port)
     if (!conn)
         return;
 
-    client_start(conn);
-    while (1) {
-        client_update();
+    client_poller = network_poller_create();
+    if (!client_poller || network_poller_add_connection(client_poller, conn, NETWORK_POLLIN, NULL) != 0) {
+        network_connection_destroy(conn);
+        return;
     }
 
+    client_start(conn);
+    while (client_update() == 0)
+        ;
+
+    network_poller_destroy(client_poller);
     network_connection_destroy(conn);
 }
 
@@ -173,22 +251,30 @@ void main_host(short port)
     server_init(port, MAX_PLAYER); printf("Server listening on port %d...\n", port);
     client_start(NULL);
     while (1) {
-        server_update();
+        server_update(0);
         if (server_is_idling())
             client_update();
     }
 }
 
+void main_server(short port)
+{
+    const int MAX_PLAYER = 3;
+    server_init(port, MAX_PLAYER); printf("Dedicated server listening on port %d...\n", port);
+    while (1)
+        server_update(-1);
+}
+
 int main(int argc, char *argv[])
 {
     PRINTF_RESET();
     printf("CUNO Start.\n");
 
-    if (argc == 3) {
-        /* if (strcmp(argv[2], "-s") == 0) {
-            main_host(atoi(argv[1]));
-            return 0;
-        } */
+    if (argc >= 3 && strcmp(argv[2], "-s") == 0) {
+        if (argc == 4)
+            server_set_replay_dir(argv[3]);
+        main_server(atoi(argv[1]));
+    } else if (argc == 3) {
         main_client(argv[1], atoi(argv[2]));
     } else if (argc == 2) {
         main_host(atoi(argv[1]));
@@ -58,6 +58,9 @@ static const float                      CUNO_PORT = 7777;
 /******* RESOURCES *******/
 static struct game_state                game_state_alt;
 static struct game_state                game_state_mut;
+static struct game_state_delta          game_state_delta;
+static uint32_t                         game_state_seq;
+static char                             game_state_desynced;
 static const struct game_state         *game_state = &game_state_mut;
 static int                              this_player_id;
 static int                              this_player_idx;
@@ -81,7 +84,8 @@ static mat4                             orthographic;
 DEFINE_ARRAY_LIST_WRAPPER(static, struct act, act_list);
 static char                             gamelog_charbuff[4096]  = {0};
 static char                             ipv4_chrbuff[64]        = {0};
-static card_id_t                        entity_card_id_map[ENTITY_MAX] = {(card_id_t)-1};
+DEFINE_ENTITY_MAP(static, card_id_t, card_id_map, (card_id_t)-1)
+static struct card_id_map               entity_card_id_map;
 
 static struct act                       curr_act;
 static struct act_list                  staged_acts;
@@ -131,12 +135,15 @@ static void entity_card_represent(entity_t entity_card, const struct card *card)
     struct comp_transform      *transf;
     struct comp_visual         *visual;
     entity_t                    text;
+    card_id_t                  *card_id;
 
     visual          = comp_system_visual_get(world_main.sys_vis, entity_card);
     visual->color   = card_color_to_rgb(card->color);
-    entity_card_id_map[entity_card] = card->id;
+    card_id         = card_id_map_at(&entity_card_id_map, entity_index(entity_card));
+    if (card_id)
+        *card_id    = card->id;
 
-    text            = comp_system_family_view(world_main.sys_fam).first_child_map[entity_card];
+    text            = comp_family_view_first_child(comp_system_family_view(world_main.sys_fam), entity_card);
     transf          = comp_system_transform_get(world_main.sys_transf, text);
     visual          = comp_system_visual_get(world_main.sys_vis, text);
     if (visual->vertecies)
@@ -173,6 +180,7 @@ static void entity_card_represent(entity_t entity_card, const struct card *card)
             break;
     }
     visual->color = card->color == CARD_COLOR_BLACK ? VEC3_ONE : VEC3_ZERO;
+    comp_system_transform_desync(world_main.sys_transf, text);
 }
 
 static entity_t entity_card_create(const struct card *card)
@@ -184,10 +192,16 @@ static entity_t entity_card_create(const struct card *card)
     struct comp_visual         *visual;
     struct comp_hitrect        *hitrect;
     struct comp_interpolator   *interp;
-    entity_t                    main,
+    entity_t                    pair[2],
+                                main,
                                 text;
 
-    main                    = entity_record_activate(&world_main.records);
+    if (entity_record_activate_many(&world_main.records, pair, 2) < 2) {
+        entity_record_deactivate_many(&world_main.records, pair, 1);
+        return ENTITY_INVALID;
+    }
+    main                    = pair[0];
+    text                    = pair[1];
     transf                  = comp_system_transform_emplace(world_main.sys_transf, main);
     visual                  = comp_system_visual_emplace(world_main.sys_vis, main, PROJ_PERSP);
     interp                  = comp_system_interpolator_emplace(world_main.sys_interp, main);
@@ -206,7 +220,6 @@ static entity_t entity_card_create(const struct card *card)
     interp->opt.ease_in     = 0.1f;
     interp->opt.ease_out    = 0.2f;
 
-    text                    = entity_record_activate(&world_main.records);
     transf                  = comp_system_transform_emplace(world_main.sys_transf, text);
     visual                  = comp_system_visual_emplace(world_main.sys_vis, text, PROJ_PERSP);
     comp_transform_set_default(transf);
@@ -220,20 +233,19 @@ static entity_t entity_card_create(const struct card *card)
 
     return main;
 }
-static void entity_card_destroy(entity_t main)
+/* Leaves both entities cleaned up in pair, ready to be deactivated in bulk */
+static void entity_card_cleanup(entity_t main, entity_t pair[2])
 {
-    size_t index;
-    entity_t text = comp_system_family_view(world_main.sys_fam).first_child_map[main];
+    entity_t text = comp_family_view_first_child(comp_system_family_view(world_main.sys_fam), main);
 
     graphic_vertecies_destroy(comp_system_visual_get(world_main.sys_vis, text)->vertecies);
 
-    entity_card_id_map[main] = -1;
+    *card_id_map_at(&entity_card_id_map, entity_index(main)) = -1;
 
     entity_world_cleanup(&world_main, main);
     entity_world_cleanup(&world_main, text);
-
-    entity_record_deactivate(&world_main.records, main);
-    entity_record_deactivate(&world_main.records, text);
+    pair[0] = main;
+    pair[1] = text;
 }
 /* TODO: Factor a "move_by" system */
 static void entity_card_start_raise(entity_t card) 
@@ -256,18 +268,23 @@ static void entity_card_start_unraise(entity_t card)
 }
 static void entity_discards_free_old()
 {
-    const size_t    FIRST = 0;
     const int       MIN_LEN = 4;
+    static struct entity_list freed;
+    entity_t       *pairs;
     int             new_len,
                     i;
 
     if (main_entity_discard.len < MIN_LEN) return;
     new_len = main_entity_discard.len/2;
-    
-    for (i = 0; i < new_len; i++) 
-        entity_card_destroy(main_entity_discard.elems[i]);
+
+    entity_list_clear(&freed);
+    pairs = entity_list_emplace(&freed, new_len*2);
     for (i = 0; i < new_len; i++) 
-        entity_list_remove_sft(&main_entity_discard, &FIRST, 1);
+        entity_card_cleanup(main_entity_discard.elems[i], pairs + i*2);
+    entity_record_deactivate_many(&world_main.records, freed.elems, freed.len);
+
+    main_entity_discard.len -= new_len;
+    memmove(main_entity_discard.elems, main_entity_discard.elems + new_len, main_entity_discard.len * sizeof(entity_t));
 }
 
 static void entity_player_add_cards(entity_t player, const struct card *cards, int amount)
@@ -286,12 +303,13 @@ static void entity_player_add_cards(entity_t player, const struct card *cards, i
 
     for (i = 0; i < amount; i++) {
         entity_card             = entity_card_create(cards + i);
-        comp_transf_card        = comp_system_transform_get(world_main.sys_transf, entity_card);
-
+        if (entity_is_invalid(entity_card))
+            break;
         comp_system_transform_desync(world_main.sys_transf, entity_card);
         comp_system_family_adopt(world_main.sys_fam, player, entity_card);
         
-        target = comp_system_transform_get(world_main.sys_transf, entity_card)->data;
+        comp_transf_card        = comp_system_transform_get(world_main.sys_transf, entity_card);
+        target = comp_transf_card->data;
         target.trans.x          = ENTITY_CARD_DIST * (child_count + i);
         target.trans.y          = 0;
         target.trans.z          = 0;
@@ -309,11 +327,11 @@ static int entity_player_remove_card(entity_t entity_card)
     if (entity_is_invalid(entity_card))
         return -1;
     family_view     = comp_system_family_view(world_main.sys_fam);
-    current         = family_view.first_child_map[family_view.parent_map[entity_card]];
+    current         = comp_family_view_first_child(family_view, comp_family_view_parent(family_view, entity_card));
 
     
-    for (counter = 0; current != entity_card; counter++) current = family_view.sibling_map[current];
-    current = family_view.sibling_map[current];
+    for (counter = 0; current != entity_card; counter++) current = comp_family_view_sibling(family_view, current);
+    current = comp_family_view_sibling(family_view, current);
     
     while(!entity_is_invalid(current)) {
         target          = comp_system_transform_get(world_main.sys_transf, current)->data;
@@ -322,7 +340,7 @@ static int entity_player_remove_card(entity_t entity_card)
         target.trans.z  = 0;
         comp_system_interpolator_change(world_main.sys_interp, current, target);
 
-        current = family_view.sibling_map[current];
+        current = comp_family_view_sibling(family_view, current);
         counter++;
     }
     comp_system_transform_get(world_main.sys_transf, entity_card)->data = comp_system_transform_get_world(world_main.sys_transf, entity_card);
@@ -358,11 +376,11 @@ static void staged_acts_clear()
     size_t                          i;
 
     view        = comp_system_family_view(world_main.sys_fam);
-    entity_card = view.first_child_map[main_entity_players[this_player_idx]];
+    entity_card = comp_family_view_first_child(view, main_entity_players[this_player_idx]);
 
-    for (;!entity_is_invalid(entity_card); entity_card = view.sibling_map[entity_card]) {
+    for (;!entity_is_invalid(entity_card); entity_card = comp_family_view_sibling(view, entity_card)) {
         for (i = 0; i < staged_acts.len; i++) {
-            if (staged_acts.elems[i].args.play.card_id == entity_card_id_map[entity_card])
+            if (staged_acts.elems[i].args.play.card_id == card_id_map_get(&entity_card_id_map, entity_index(entity_card)))
                 break;
         }
         if (i == staged_acts.len)
@@ -404,31 +422,42 @@ static void scene_remove_player_cards(const struct player *player, entity_t enti
 {
     entity_t                        entity_card,
                                     last_discard = ENTITY_INVALID,
+                                    last_hidden = ENTITY_INVALID,
                                     next;
     struct comp_system_family_view  family_view;
     int                             children_count;
     int                             i;
 
     family_view = comp_system_family_view(world_main.sys_fam);
-    entity_card = next = family_view.first_child_map[entity_player];
+    entity_card = next = comp_family_view_first_child(family_view, entity_player);
 
     for (; !entity_is_invalid(entity_card); entity_card = next) {
         for (i = 0; i < player->hand.len; i++) {
-            if (player->hand.elems[i].id == entity_card_id_map[entity_card])
+            if (player->hand.elems[i].id == card_id_map_get(&entity_card_id_map, entity_index(entity_card)))
                 break;
         }
 
-        next = family_view.sibling_map[entity_card];
+        next = comp_family_view_sibling(family_view, entity_card);
         if (i < player->hand.len)
             continue;
 
-        if (entity_card_id_map[entity_card] == game_state->top_card.id) {
+        if (card_id_map_get(&entity_card_id_map, entity_index(entity_card)) == game_state->top_card.id) {
             last_discard = entity_card;
+        } else if (card_id_map_get(&entity_card_id_map, entity_index(entity_card)) >= CARD_ID_HIDDEN(0, 0)) {
+            if (last_hidden != ENTITY_INVALID)
+                entity_discards_discard(last_hidden);
+            last_hidden = entity_card;
         } else {
             entity_discards_discard(entity_card);
         }
     }
 
+    /* Hidden hands carry positional ids, so the played card never matches the top card by id */
+    if (last_discard == ENTITY_INVALID)
+        last_discard = last_hidden;
+    else if (last_hidden != ENTITY_INVALID)
+        entity_discards_discard(last_hidden);
+
     if (last_discard != ENTITY_INVALID) {
         entity_card_represent(last_discard, &game_state->top_card);
         entity_discards_discard(last_discard);
@@ -473,7 +502,7 @@ static int resources_init(struct graphic_session *created_session)
     ortho_height = session_info.height;
 
     handle = asset_open(ASSET_PATH_FONT);
-    if (asset_read(buffer, 1<<19, handle)) {
+    if (asset_read(buffer, 1<<19, handle) > 0) {
         font_spec_default = create_ascii_baked_font(buffer);
         font_tex = graphic_texture_create(font_spec_default.width, font_spec_default.height, font_spec_default.bitmap, 1);
     }
@@ -537,7 +566,7 @@ static void staged_acts_try_play(entity_t entity_card)
         last_attempt = entity_card;
     }
 
-    card = active_player_find_card(game_state, entity_card_id_map[entity_card]);
+    card = active_player_find_card(game_state, card_id_map_get(&entity_card_id_map, entity_index(entity_card)));
 
     curr_act.type = ACT_PLAY;
     curr_act.args.play.card_id = card->id;
@@ -565,7 +594,7 @@ static void staged_acts_try_unplay(entity_t entity_card)
 
     game_state_copy_into(&game_state_alt, game_state);
     for (i = 0; i < staged_acts.len; i++) {
-        if (staged_acts.elems[i].args.play.card_id == entity_card_id_map[entity_card]) {
+        if (staged_acts.elems[i].args.play.card_id == card_id_map_get(&entity_card_id_map, entity_index(entity_card))) {
             card_index = i;
             continue;
         }
@@ -589,7 +618,7 @@ static void on_card_hit(entity_t entity_card)
     int i;
 
     for (i = 0; i < staged_acts.len; i++) {
-        if (staged_acts.elems[i].args.play.card_id == entity_card_id_map[entity_card])
+        if (staged_acts.elems[i].args.play.card_id == card_id_map_get(&entity_card_id_map, entity_index(entity_card)))
             break;
     }
     if (i == staged_acts.len) {
@@ -618,6 +647,33 @@ static void send_server_act(struct act act)
     act_serialize(&sendbuff.tail, act);
 }
 
+static void send_server_lobby_join()
+{
+    struct lobby_join join = { .seats = 0 };
+    struct network_header hdr = {
+        .version = NETMSG_VER_MAX, /* the server answers in the highest version both sides know */
+        .type = MSG_LB_JOIN,
+        .len = lobby_join_serialize(NULL, join)
+    };
+
+    network_buffer_make_space(&sendbuff, hdr.len + NETHDR_SERIALIZED_SIZE);
+    network_header_serialize(&sendbuff.tail, &hdr);
+    lobby_join_serialize(&sendbuff.tail, join);
+}
+
+static void send_server_resync()
+{
+    struct network_header hdr = {
+        .version = NETMSG_VER,
+        .type = MSG_GM_RESYNC,
+        .len = 0
+    };
+
+    game_state_desynced = 1;
+    network_buffer_make_space(&sendbuff, NETHDR_SERIALIZED_SIZE);
+    network_header_serialize(&sendbuff.tail, &hdr);
+}
+
 static void send_server_act_plays()
 {
     struct act end = { .type = ACT_END_TURN };
@@ -666,13 +722,13 @@ static void on_state_make_act()
                                     entity_card;
     int                             i;
     view        = comp_system_family_view(world_main.sys_fam);
-    entity_card = view.first_child_map[main_entity_players[this_player_idx]];
+    entity_card = comp_family_view_first_child(view, main_entity_players[this_player_idx]);
 
     while (!entity_is_invalid(entity_card)) {
         if (comp_system_hitrect_check_and_clear_state(world_main.sys_hitrect, entity_card))
             break;
 
-        entity_card = view.sibling_map[entity_card];
+        entity_card = comp_family_view_sibling(view, entity_card);
     }
     if (!entity_is_invalid(entity_card))
         on_card_hit(entity_card);
@@ -762,6 +818,7 @@ void handle_local_recv(short type, const void *data)
 void network_update()
 {
     struct network_header header;
+    uint32_t seq;
 
     network_connection_sendrecv_nb(server_conn, &sendbuff, &recvbuff);
     while (NETWORK_BUFFER_LEN(recvbuff)) {
@@ -776,11 +833,28 @@ void network_update()
                 active_world = &world_main;
                 return;
             case MSG_GM_STATE:
-                game_state_deserialize(&game_state_mut, &recvbuff.head);
+                game_state_seq = network_unpack_u32(&recvbuff.head);
+                game_state_deserialize(&game_state_mut, &recvbuff.head, header.version);
+                game_state_private_deserialize(&game_state_mut, &recvbuff.head, header.version);
+                game_state_desynced = 0;
+                on_game_state_update();
+                return;
+            case MSG_GM_DELTA:
+                seq = network_unpack_u32(&recvbuff.head);
+                game_state_delta_deserialize(&game_state_delta, &recvbuff.head, header.version);
+                game_state_delta_private_deserialize(&game_state_delta, &recvbuff.head, header.version);
+                if (game_state_desynced)
+                    continue;
+                if (seq != game_state_seq + 1 || game_state_apply_delta(&game_state_mut, &game_state_delta) != 0) {
+                    send_server_resync();
+                    continue;
+                }
+                game_state_seq = seq;
                 on_game_state_update();
                 return;
             default:
                 cuno_logf(LOG_ERR, "Unhandled MSG type %d\n", header.type);
+                recvbuff.head += header.len;
                 return;
         }
     }
@@ -826,8 +900,8 @@ static void on_btn_host(entity_t e, struct comp_hitrect *hitrect)
 {
     static int initialized = 0;
     if (!initialized) {
-        server_register_local(&handle_local_recv);
         server_init(CUNO_PORT, PLAYER_MAX);
+        server_register_local(&handle_local_recv);
         initialized = 1;
         clear_color = VEC3_BLUE;
     } else {
@@ -844,6 +918,7 @@ static void on_btn_connect(entity_t e, struct comp_hitrect *hitrect)
         clear_color = VEC3_RED;
         return;
     }
+    send_server_lobby_join();
     active_world = &world_main;
 }
 
@@ -950,17 +1025,12 @@ int game_init(struct graphic_session *created_session)
 {
     const int PLAYER_AMOUNT     = 2;
     const int DEAL_PER_PLAYER   = 4;
-    /* const unsigned int seed     = 1506742; */
-    const unsigned int seed  = get_monotonic_time();
-
-    srand(seed);
-    cuno_logf(LOG_INFO, "srand seed: %u", seed);
-
     if (!resources_init(created_session))
         return -1;
 
     network_buffer_init(&sendbuff, 128);
     network_buffer_init(&recvbuff, 1024);
+    game_state_delta_init(&game_state_delta);
 
     default_txtopt.font_tex     = font_tex,
     default_txtopt.font_spec    = &font_spec_default;
@@ -988,7 +1058,7 @@ void game_update()
 
     network_update();
     if (is_hosting)
-        server_update();
+        server_update(0);
     /* if (active_world == &world_main)
         player_auto(); */
 
@@ -1007,5 +1077,5 @@ void game_mouse_event(struct mouse_event event)
 
     comp_system_hitrect_update(active_world->sys_hitrect, &mouse_orthospace, &mouse_camspace_ray, mask); 
     on_hitrect_state_update();
-    comp_system_hitrect_clear_states(active_world->sys_hitrect); /* Forces checks every frame, wastefully */
+    comp_system_hitrect_clear_states(active_world->sys_hitrect); /* Presses the ui state didn't consume don't carry over */
 }
@@ -39,49 +39,90 @@ const struct card *active_player_find_card(const struct game_state *game, card_i
     return NULL;
 }
 
-static void card_random(struct card *card, card_id_t id)
+/* DECK */
+/* Ids follow a physical deck: per color one 0 and two of each 1-9, then per color
+ * two of each reverse, skip and plus 2, then 4 pick colors and 4 plus 4s */
+static void card_from_id(struct card *card, card_id_t id)
 {
-    const float RATIO = RAND_MAX / 110.0;
-    int random = rand();
+    card->id  = id;
+    card->num = 0;
 
-    card->id            = id;
-    card->color         = random % 4;
-
-    if ( random <= RATIO * 76 ) {
-        card->type = CARD_NUMBER;
-        card->num  = random % 10;
+    if ( id < 76 ) {
+        card->type  = CARD_NUMBER;
+        card->color = id / 19;
+        card->num   = (id % 19 + 1) / 2;
     }
-    else if ( random <= RATIO * 84 )
-        card->type = CARD_REVERSE;
-
-    else if ( random <= RATIO * 92 )
-        card->type = CARD_SKIP;
-
-    else if ( random <= RATIO * 100 )
-        card->type = CARD_PLUS2;
-    
-    else if ( random <= RATIO * 104 ) {
-        card->color = CARD_COLOR_BLACK;
-        card->type  = CARD_PICK_COLOR;
+    else if ( id < 100 ) {
+        card->color = (id - 76) / 6;
+        switch ((id - 76) % 6 / 2) {
+            case 0:  card->type = CARD_REVERSE; break;
+            case 1:  card->type = CARD_SKIP;    break;
+            default: card->type = CARD_PLUS2;   break;
+        }
     }
-    else if ( random <= RATIO * 108 ) {
+    else {
         card->color = CARD_COLOR_BLACK;
-        card->type  = CARD_PLUS4;
+        card->type  = id < 104 ? CARD_PICK_COLOR : CARD_PLUS4;
     }
-    else if ( random <= RATIO * 110 ) {
-        card->color = CARD_COLOR_BLACK;
-        /* card->type  = CARD_SWAP; */
-        card->type  = CARD_PICK_COLOR;
+}
+
+static void deck_shuffle(struct rng *rng, card_id_t *ids, int len)
+{
+    card_id_t temp;
+    int i, j;
+
+    for (i = len - 1; i > 0; i--) {
+        j       = rng_range(rng, i + 1);
+        temp    = ids[i];
+        ids[i]  = ids[j];
+        ids[j]  = temp;
+    }
+}
+
+static void deck_init(struct deck *deck, struct rng *rng)
+{
+    int i;
+
+    for (i = 0; i < DECK_SIZE; i++)
+        deck->draw[i] = i;
+    deck->draw_next     = 0;
+    deck->draw_len      = DECK_SIZE;
+    deck->discard_len   = 0;
+    deck_shuffle(rng, deck->draw, DECK_SIZE);
+}
+
+/* Returns -1 only when every card is held in a hand or on top */
+static int deck_draw(struct deck *deck, struct rng *rng, struct card *card)
+{
+    if (deck->draw_next == deck->draw_len) {
+        if (!deck->discard_len)
+            return -1;
+
+        memcpy(deck->draw, deck->discard, deck->discard_len * sizeof(card_id_t));
+        deck->draw_next     = 0;
+        deck->draw_len      = deck->discard_len;
+        deck->discard_len   = 0;
+        deck_shuffle(rng, deck->draw, deck->draw_len);
     }
+    /* Rebuilt from the id, so a wild comes back black */
+    card_from_id(card, deck->draw[deck->draw_next++]);
+    return 0;
 }
 
-static void append_player_rand_cards(struct game_state *state, int player_index, int amount)
+static void deck_discard(struct deck *deck, card_id_t id)
 {
+    deck->discard[deck->discard_len++] = id;
+}
+
+static int append_player_cards(struct game_state *game, int player_index, int amount)
+{
+    struct card_list *hand = &game->players[player_index].hand;
+    struct card card;
     int i;
-    struct card *card = card_list_emplace(&state->players[player_index].hand, amount);
 
-    for (i = 0; i < amount; i++)
-        card_random(card + i, state->card_id_last++);
+    for (i = 0; i < amount && deck_draw(&game->deck, &game->rng, &card) == 0; i++)
+        *card_list_emplace(hand, 1) = card;
+    return i;
 }
 
 int card_needs_color_arg(const struct card *card)
@@ -128,24 +169,31 @@ void game_state_init(struct game_state *game)
     game->skip_pool             = 0;
     game->batsu_pool            = 0;
     game->player_len            = 0;
+    game->curr_act              = ACT_NONE;
     memset(game->players, 0, sizeof(game->players));
+    memset(&game->deck, 0, sizeof(game->deck));
 }
 
-void game_state_start(struct game_state *game, int player_len, int deal)
+void game_state_start(struct game_state *game, int player_len, int deal, uint64_t seed)
 {
     int i;
 
+    game->seed = seed;
+    rng_seed(&game->rng, seed, 0);
+    deck_init(&game->deck, &game->rng);
     game->player_len = min(player_len, PLAYER_MAX);
+    /* Leave at least one card that isn't a pick color to open with */
+    deal = min(deal, (DECK_SIZE - 5) / max(game->player_len, 1));
 
     for (i = 0; i < game->player_len; i++) {
         game->players[i].id = i;
         card_list_init(&game->players[i].hand, deal);
-        append_player_rand_cards(game, i, deal);
+        append_player_cards(game, i, deal);
     }
 
-    do
-        card_random(&game->top_card, game->card_id_last++); 
-    while (game->top_card.type == CARD_PICK_COLOR);
+    /* Wilds can't open, they go straight to the discards */
+    while (deck_draw(&game->deck, &game->rng, &game->top_card) == 0 && game->top_card.type == CARD_PICK_COLOR)
+        deck_discard(&game->deck, game->top_card.id);
     play_card_effect(game, &game->top_card, CARD_COLOR_RED);
 }
 
@@ -186,8 +234,117 @@ void game_state_for_player(struct game_state *state, int player_id)
 
         for (j = 0; j < state->players[i].hand.len; j++) {
             CARD_HIDE(state->players[i].hand.elems[j]);
+            state->players[i].hand.elems[j].id = CARD_ID_HIDDEN(i, j);
         }
     }
+    /* The draw order and the rng predict every future card */
+    memset(&state->deck, 0, sizeof(state->deck));
+    memset(&state->rng, 0, sizeof(state->rng));
+    state->seed = 0;
+}
+
+/* DELTA */
+void game_state_delta_init(struct game_state_delta *delta)
+{
+    int i;
+
+    memset(delta, 0, sizeof(struct game_state_delta));
+    for (i = 0; i < PLAYER_MAX; i++) {
+        card_id_list_init(&delta->hands[i].removed, 8);
+        card_list_init(&delta->hands[i].added, 8);
+    }
+}
+
+void game_state_delta_deinit(struct game_state_delta *delta)
+{
+    int i;
+    for (i = 0; i < PLAYER_MAX; i++) {
+        card_id_list_deinit(&delta->hands[i].removed);
+        card_list_deinit(&delta->hands[i].added);
+    }
+}
+
+static int card_list_find_id(const struct card_list *list, card_id_t id)
+{
+    int i;
+    for (i = 0; i < list->len; i++) {
+        if (list->elems[i].id == id)
+            return i;
+    }
+    return -1;
+}
+
+void game_state_diff(struct game_state_delta *delta, const struct game_state *from, const struct game_state *to)
+{
+    const struct card_list *old_hand, *new_hand;
+    struct hand_delta      *hand;
+    int i, j;
+
+    delta->turn                 = to->turn;
+    delta->ended                = to->ended;
+    delta->active_player_index  = to->active_player_index;
+    delta->top_card             = to->top_card;
+    delta->turn_dir             = to->turn_dir;
+    delta->skip_pool            = to->skip_pool;
+    delta->batsu_pool           = to->batsu_pool;
+    delta->player_len           = to->player_len;
+
+    for (i = 0; i < to->player_len; i++) {
+        hand     = delta->hands + i;
+        old_hand = &from->players[i].hand;
+        new_hand = &to->players[i].hand;
+
+        card_id_list_clear(&hand->removed);
+        card_list_clear(&hand->added);
+
+        for (j = 0; j < old_hand->len; j++) {
+            if (card_list_find_id(new_hand, old_hand->elems[j].id) < 0)
+                *card_id_list_emplace(&hand->removed, 1) = old_hand->elems[j].id;
+        }
+        for (j = 0; j < new_hand->len; j++) {
+            if (card_list_find_id(old_hand, new_hand->elems[j].id) < 0)
+                *card_list_emplace(&hand->added, 1) = new_hand->elems[j];
+        }
+    }
+}
+
+/* Returns -1 when the delta doesn't fit the state, which then needs a full resync.
+ * Unknown ids stand for hidden cards: removals pop the hand's last card and
+ * additions take a positional id */
+int game_state_apply_delta(struct game_state *game, const struct game_state_delta *delta)
+{
+    const struct hand_delta *hand;
+    struct card_list        *cards;
+    int i, j, idx;
+
+    if (delta->player_len != game->player_len)
+        return -1;
+
+    for (i = 0; i < delta->player_len; i++) {
+        hand  = delta->hands + i;
+        cards = &game->players[i].hand;
+
+        for (j = 0; j < hand->removed.len; j++) {
+            idx = hand->removed.elems[j] == CARD_ID_UNKNOWN ? (int)cards->len - 1 : card_list_find_id(cards, hand->removed.elems[j]);
+            if (idx < 0)
+                return -1;
+            cards->elems[idx] = cards->elems[--cards->len];
+        }
+        for (j = 0; j < hand->added.len; j++) {
+            *card_list_emplace(cards, 1) = hand->added.elems[j];
+            if (hand->added.elems[j].id == CARD_ID_UNKNOWN)
+                cards->elems[cards->len - 1].id = CARD_ID_HIDDEN(i, cards->len - 1);
+        }
+    }
+
+    game->turn                  = delta->turn;
+    game->ended                 = delta->ended;
+    game->active_player_index   = delta->active_player_index;
+    game->top_card              = delta->top_card;
+    game->turn_dir              = delta->turn_dir;
+    game->skip_pool             = delta->skip_pool;
+    game->batsu_pool            = delta->batsu_pool;
+    return 0;
 }
 
 /* ACTS */
@@ -208,7 +365,7 @@ static int game_state_act_draw(struct game_state *game)
         game->batsu_pool = 0;
     }
 
-    append_player_rand_cards(game, game->active_player_index, amount);
+    append_player_cards(game, game->active_player_index, amount);
 
     game->curr_act = ACT_DRAW;
     return 0;
@@ -261,6 +418,7 @@ static int game_state_act_play(struct game_state *game, struct act_args_play arg
     if (!game_state_can_act_play(game, args))
         return -1;
 
+    deck_discard(&game->deck, game->top_card.id);
     game->top_card = player->hand.elems[index];
     play_card_effect(game, &game->top_card, args.color);
     card_list_remove_swp(&player->hand, &index, 1);
@@ -276,7 +434,7 @@ static int game_state_can_act_end_turn(const struct game_state *game)
 
 static int game_state_act_end_turn(struct game_state *game)
 {
-    int increment;
+    int increment, active;
 
     if (game->ended || !game->curr_act)
         return -1;
@@ -289,9 +447,9 @@ static int game_state_act_end_turn(struct game_state *game)
     increment = (1 + game->skip_pool) * game->turn_dir;
     game->skip_pool = 0;
 
-    game->active_player_index = (game->active_player_index + increment) % game->player_len;
-    if (game->active_player_index < 0)
-        game->active_player_index += game->player_len;
+    /* Signed, an unsigned index would wrap backwards turns around 2^32 instead */
+    active = ((int)game->active_player_index + increment) % (int)game->player_len;
+    game->active_player_index = active < 0 ? active + game->player_len : active;
 
     game->curr_act = ACT_NONE;
     game->turn++;
@@ -2,12 +2,17 @@
 #define GAME_LOGIC_H
 #include <stdlib.h>
 #include "engine/math.h"
+#include "engine/random.h"
 #include "engine/array_list.h"
 
 #define is_pickable_color(color) ( 0 <= (color) && (color) <= 3 )
 #define PLAYER_NAME_MAX 64
 #define PLAYER_MAX 5
 #define PLAY_ARG_MAX 6
+#define DECK_SIZE 108
+/* Hidden cards without a known id are numbered by seat and hand position */
+#define CARD_ID_UNKNOWN ((card_id_t)0xFFFF)
+#define CARD_ID_HIDDEN(player_idx, pos) ((card_id_t)(0xC000 | (player_idx) << 10 | (pos)))
 #define CARD_HIDE(card) do { (card).type = CARD_UNKNOWN; (card).num = -1; (card).color = CARD_COLOR_MAX; } while(0)
 
 enum card_color {
@@ -37,6 +42,15 @@ struct card {
     unsigned short      num;
 };
 DEFINE_ARRAY_LIST_WRAPPER(static, struct card, card_list)
+DEFINE_ARRAY_LIST_WRAPPER(static, card_id_t, card_id_list)
+/* Card ids index a fixed deck, so each id names one physical card for the whole game */
+struct deck {
+    card_id_t           draw[DECK_SIZE];
+    unsigned short      draw_next;
+    unsigned short      draw_len;
+    card_id_t           discard[DECK_SIZE];
+    unsigned short      discard_len;
+};
 struct player {
     unsigned int        id;
     char                name[PLAYER_NAME_MAX];
@@ -63,8 +77,6 @@ struct game_state {
     struct player       players[PLAYER_MAX];
     unsigned int        player_len;
 
-    card_id_t           card_id_last;
-
     int                 turn;
     int                 ended;
     unsigned int        active_player_index;
@@ -74,15 +86,43 @@ struct game_state {
     int                 turn_dir;
     unsigned int        skip_pool;
     unsigned int        batsu_pool;
+
+    /* Every shuffle comes from here, so a seed reproduces the whole game */
+    uint64_t            seed;
+    struct rng          rng;
+    struct deck         deck;
+};
+struct hand_delta {
+    struct card_id_list removed;
+    struct card_list    added;
+};
+/* Difference between two states of one game, hands are matched by card id */
+struct game_state_delta {
+    int                 turn;
+    int                 ended;
+    unsigned int        active_player_index;
+
+    struct card         top_card;
+    int                 turn_dir;
+    unsigned int        skip_pool;
+    unsigned int        batsu_pool;
+
+    unsigned int        player_len;
+    struct hand_delta   hands[PLAYER_MAX];
 };
 
 
 void game_state_init(struct game_state *game);
 void game_state_deinit(struct game_state *game);
 void game_state_copy_into(struct game_state *dst, const struct game_state *src);
-void game_state_start(struct game_state *game, int player_len, int deal);
+void game_state_start(struct game_state *game, int player_len, int deal, uint64_t seed);
 void game_state_for_player(struct game_state *game, int player_id);
 
+void game_state_delta_init(struct game_state_delta *delta);
+void game_state_delta_deinit(struct game_state_delta *delta);
+void game_state_diff(struct game_state_delta *delta, const struct game_state *from, const struct game_state *to);
+int game_state_apply_delta(struct game_state *game, const struct game_state_delta *delta);
+
 const struct card *game_state_get_card(const struct game_state *game, card_id_t card_id);
 int game_state_can_act(const struct game_state *game, struct act act);
 int game_state_act(struct game_state *game, struct act act);
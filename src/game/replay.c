@@ -0,0 +1,328 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "engine/system/log.h"
+#include "serialize.h"
+#include "replay.h"
+
+#define REPLAY_HEADER_SIZE      16
+#define REPLAY_CHECKPOINT_MAX   4096
+
+/* CHECKPOINT STATE */
+static size_t checkpoint_serialize(u8 **cursor, const struct game_state *game)
+{
+    size_t total = 0;
+    int i;
+
+    total += network_pack_u32(cursor, game->turn);
+    total += network_pack_u8(cursor, game->ended);
+    total += network_pack_u8(cursor, game->active_player_index);
+    total += network_pack_u8(cursor, game->curr_act);
+    total += network_pack_u8(cursor, game->turn_dir);
+    total += network_pack_u16(cursor, game->skip_pool);
+    total += network_pack_u16(cursor, game->batsu_pool);
+    total += card_serialize(cursor, &game->top_card);
+
+    total += network_pack_u64(cursor, game->seed);
+    total += network_pack_u64(cursor, game->rng.state);
+    total += network_pack_u64(cursor, game->rng.inc);
+
+    total += network_pack_u16(cursor, game->deck.draw_next);
+    total += network_pack_u16(cursor, game->deck.draw_len);
+    for (i = 0; i < game->deck.draw_len; i++)
+        total += network_pack_u16(cursor, game->deck.draw[i]);
+    total += network_pack_u16(cursor, game->deck.discard_len);
+    for (i = 0; i < game->deck.discard_len; i++)
+        total += network_pack_u16(cursor, game->deck.discard[i]);
+
+    total += network_pack_u8(cursor, game->player_len);
+    for (i = 0; i < game->player_len; i++) {
+        total += network_pack_u8(cursor, game->players[i].id);
+        total += card_list_serialize(cursor, &game->players[i].hand, -1);
+    }
+    return total;
+}
+
+static void checkpoint_deserialize(struct game_state *game, u8 **cursor)
+{
+    unsigned int player_len, len;
+    int i;
+
+    game->turn                = network_unpack_u32(cursor);
+    game->ended               = network_unpack_u8(cursor);
+    game->active_player_index = network_unpack_u8(cursor);
+    game->curr_act            = network_unpack_u8(cursor);
+    game->turn_dir            = (s8)network_unpack_u8(cursor);
+    game->skip_pool           = network_unpack_u16(cursor);
+    game->batsu_pool          = network_unpack_u16(cursor);
+    card_deserialize(&game->top_card, cursor);
+
+    game->seed                = network_unpack_u64(cursor);
+    game->rng.state           = network_unpack_u64(cursor);
+    game->rng.inc             = network_unpack_u64(cursor);
+
+    game->deck.draw_next      = network_unpack_u16(cursor);
+    len                       = network_unpack_u16(cursor);
+    game->deck.draw_len       = min(len, DECK_SIZE);
+    for (i = 0; i < game->deck.draw_len; i++)
+        game->deck.draw[i] = network_unpack_u16(cursor);
+    len                       = network_unpack_u16(cursor);
+    game->deck.discard_len    = min(len, DECK_SIZE);
+    for (i = 0; i < game->deck.discard_len; i++)
+        game->deck.discard[i] = network_unpack_u16(cursor);
+    game->deck.draw_next      = min(game->deck.draw_next, game->deck.draw_len);
+
+    player_len = network_unpack_u8(cursor);
+    player_len = min(player_len, PLAYER_MAX);
+    for (i = player_len; i < game->player_len; i++)
+        card_list_deinit(&game->players[i].hand);
+    for (i = game->player_len; i < player_len; i++)
+        game->players[i].hand.elems = NULL;
+    game->player_len = player_len;
+
+    for (i = 0; i < game->player_len; i++) {
+        game->players[i].id = network_unpack_u8(cursor);
+        cardlist_deserialize(&game->players[i].hand, cursor);
+    }
+}
+
+/* WRITER */
+int replay_writer_open(struct replay_writer *writer, const char *path, struct replay_header header)
+{
+    u8 buffer[REPLAY_HEADER_SIZE];
+    u8 *cursor = buffer;
+
+    writer->act_len = 0;
+    writer->file    = fopen(path, "wb");
+    if (!writer->file) {
+        cuno_logf(LOG_ERR, "REPLAY: Can't open %s for writing", path);
+        return -1;
+    }
+
+    network_pack_u32(&cursor, REPLAY_MAGIC);
+    network_pack_u16(&cursor, REPLAY_VERSION);
+    network_pack_u8(&cursor, header.player_len);
+    network_pack_u8(&cursor, header.deal);
+    network_pack_u64(&cursor, header.seed);
+    if (fwrite(buffer, 1, sizeof(buffer), writer->file) != sizeof(buffer)) {
+        replay_writer_close(writer);
+        return -1;
+    }
+    return 0;
+}
+
+/* Takes the state the act produced, every REPLAY_CHECKPOINT_INTERVAL acts it is
+ * stored whole and the file flushed, so a crash loses at most that many acts */
+int replay_writer_append(struct replay_writer *writer, struct act act, const struct game_state *after)
+{
+    u8 buffer[REPLAY_CHECKPOINT_MAX];
+    u8 *cursor = buffer;
+    size_t len;
+
+    if (!writer->file)
+        return -1;
+
+    network_pack_u8(&cursor, REPLAY_REC_ACT);
+    act_serialize(&cursor, act);
+    writer->act_len++;
+
+    /* Sizing walks the deck and every hand, so only acts that checkpoint pay for it */
+    if (writer->act_len % REPLAY_CHECKPOINT_INTERVAL == 0) {
+        len = checkpoint_serialize(NULL, after);
+        if (len + 9 <= sizeof(buffer) - (cursor - buffer)) {
+            network_pack_u8(&cursor, REPLAY_REC_CHECKPOINT);
+            network_pack_u32(&cursor, len + 4);
+            network_pack_u32(&cursor, writer->act_len);
+            checkpoint_serialize(&cursor, after);
+        }
+    }
+
+    len = cursor - buffer;
+    if (fwrite(buffer, 1, len, writer->file) != len) {
+        cuno_logf(LOG_ERR, "REPLAY: Write failed, closing the log");
+        replay_writer_close(writer);
+        return -1;
+    }
+    if (writer->act_len % REPLAY_CHECKPOINT_INTERVAL == 0)
+        fflush(writer->file);
+    return 0;
+}
+
+void replay_writer_close(struct replay_writer *writer)
+{
+    if (writer->file)
+        fclose(writer->file);
+    writer->file = NULL;
+}
+
+/* READER */
+static int replay_parse(struct replay *replay)
+{
+    struct replay_checkpoint checkpoint;
+    u8 *cursor = replay->data,
+       *end    = replay->data + replay->len,
+       *peek;
+    uint32_t len;
+
+    if (replay->len < REPLAY_HEADER_SIZE || network_unpack_u32(&cursor) != REPLAY_MAGIC)
+        return -1;
+    if (network_unpack_u16(&cursor) != REPLAY_VERSION)
+        return -1;
+    replay->header.player_len = network_unpack_u8(&cursor);
+    replay->header.deal       = network_unpack_u8(&cursor);
+    replay->header.seed       = network_unpack_u64(&cursor);
+
+    while (cursor < end) {
+        switch (*cursor) {
+            case REPLAY_REC_ACT:
+                if (end - cursor < 2 || end - cursor < (cursor[1] == ACT_PLAY ? 5 : 2))
+                    goto truncated;
+                cursor++;
+                *replay_act_list_emplace(&replay->acts, 1) = act_deserialize(&cursor);
+                break;
+
+            case REPLAY_REC_CHECKPOINT:
+                peek = cursor + 1;
+                if (end - peek < 4)
+                    goto truncated;
+                len = network_unpack_u32(&peek);
+                if (len < 8 || end - peek < len)
+                    goto truncated;
+
+                checkpoint.act_idx = network_unpack_u32(&peek);
+                checkpoint.offset  = peek - replay->data;
+                checkpoint.turn    = network_unpack_u32(&peek);
+                /* Only trust checkpoints that agree with the acts read so far */
+                if (checkpoint.act_idx == replay->acts.len)
+                    *replay_checkpoint_list_emplace(&replay->checkpoints, 1) = checkpoint;
+                cursor += 1 + 4 + len;
+                break;
+
+            default:
+                cuno_logf(LOG_WARN, "REPLAY: Unknown record %d, ignoring the rest", *cursor);
+                return 0;
+        }
+    }
+    return 0;
+
+truncated:
+    cuno_logf(LOG_WARN, "REPLAY: Log ends mid-record after %zu acts", replay->acts.len);
+    return 0;
+}
+
+int replay_load(struct replay *replay, const char *path)
+{
+    FILE *file;
+    long  len;
+
+    replay->data = NULL;
+    replay_act_list_init(&replay->acts, 256);
+    replay_checkpoint_list_init(&replay->checkpoints, 8);
+
+    file = fopen(path, "rb");
+    if (!file) {
+        cuno_logf(LOG_ERR, "REPLAY: Can't open %s", path);
+        return -1;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0)
+        goto fail;
+
+    replay->len  = len;
+    replay->data = malloc(len ? len : 1);
+    if (!replay->data || fread(replay->data, 1, len, file) != len)
+        goto fail;
+    fclose(file);
+
+    if (replay_parse(replay) != 0) {
+        cuno_logf(LOG_ERR, "REPLAY: %s is not a version %d replay", path, REPLAY_VERSION);
+        return -1;
+    }
+    return 0;
+
+fail:
+    cuno_logf(LOG_ERR, "REPLAY: Failed reading %s", path);
+    fclose(file);
+    return -1;
+}
+
+void replay_deinit(struct replay *replay)
+{
+    replay_act_list_deinit(&replay->acts);
+    replay_checkpoint_list_deinit(&replay->checkpoints);
+    free(replay->data);
+    replay->data = NULL;
+}
+
+/* game must be initialized, whatever it held is replaced */
+void replay_start(const struct replay *replay, struct game_state *game)
+{
+    game_state_deinit(game);
+    game_state_init(game);
+    game_state_start(game, replay->header.player_len, replay->header.deal, replay->header.seed);
+}
+
+int replay_restore_checkpoint(const struct replay *replay, const struct replay_checkpoint *checkpoint, struct game_state *game)
+{
+    u8 *cursor = replay->data + checkpoint->offset;
+
+    checkpoint_deserialize(game, &cursor);
+    return checkpoint->act_idx;
+}
+
+/* Rebuilds the state at the start of the given turn, or the last state when the
+ * game ended earlier. Returns how many acts that took from the start, -1 when an
+ * act doesn't apply, meaning the log doesn't belong to this build's rules */
+int replay_seek(const struct replay *replay, struct game_state *game, int turn)
+{
+    const struct replay_checkpoint *checkpoint = NULL;
+    size_t idx = 0;
+    int i;
+
+    for (i = 0; i < replay->checkpoints.len && replay->checkpoints.elems[i].turn < turn; i++)
+        checkpoint = replay->checkpoints.elems + i;
+
+    if (checkpoint)
+        idx = replay_restore_checkpoint(replay, checkpoint, game);
+    else
+        replay_start(replay, game);
+
+    for (; idx < replay->acts.len && game->turn < turn; idx++) {
+        if (game_state_act(game, replay->acts.elems[idx]) != 0)
+            return -1;
+    }
+    return idx;
+}
+
+/* Re-runs the whole log from the seed, returns the index of the first
+ * checkpoint that disagrees with the rebuilt state or -1 when all match */
+int replay_verify(const struct replay *replay)
+{
+    const struct replay_checkpoint *checkpoint;
+    u8 live[REPLAY_CHECKPOINT_MAX];
+    struct game_state game;
+    size_t idx = 0, len;
+    u8 *cursor;
+    int i, res = -1;
+
+    game_state_init(&game);
+    replay_start(replay, &game);
+    for (i = 0; i < replay->checkpoints.len && res < 0; i++) {
+        checkpoint = replay->checkpoints.elems + i;
+        for (; idx < checkpoint->act_idx; idx++) {
+            if (game_state_act(&game, replay->acts.elems[idx]) != 0)
+                break;
+        }
+
+        len = checkpoint_serialize(NULL, &game);
+        if (idx != checkpoint->act_idx || len > sizeof(live) || checkpoint->offset + len > replay->len) {
+            res = i;
+            break;
+        }
+        cursor = live;
+        checkpoint_serialize(&cursor, &game);
+        if (memcmp(live, replay->data + checkpoint->offset, len) != 0)
+            res = i;
+    }
+    game_state_deinit(&game);
+    return res;
+}
@@ -0,0 +1,58 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+#include <stdio.h>
+#include <stdint.h>
+#include "logic.h"
+
+#define REPLAY_MAGIC                0x43555250 /* "CURP" */
+#define REPLAY_VERSION              1
+#define REPLAY_CHECKPOINT_INTERVAL  64
+
+/* A replay file is a header followed by append-only records, each a u8 type
+ * and its body. Acts are stored with act_serialize, which together with the
+ * seed is enough to rebuild the game. Checkpoints hold the whole unredacted
+ * state, length prefixed, so seeking only re-runs the acts after the nearest one */
+enum replay_record_type {
+    REPLAY_REC_ACT,
+    REPLAY_REC_CHECKPOINT,
+};
+
+struct replay_header {
+    uint64_t            seed;
+    unsigned char       player_len;
+    unsigned char       deal;
+};
+
+struct replay_writer {
+    FILE               *file;
+    uint32_t            act_len;
+};
+
+struct replay_checkpoint {
+    uint32_t            act_idx;
+    int                 turn;
+    size_t              offset;
+};
+DEFINE_ARRAY_LIST_WRAPPER(static, struct act, replay_act_list)
+DEFINE_ARRAY_LIST_WRAPPER(static, struct replay_checkpoint, replay_checkpoint_list)
+
+struct replay {
+    struct replay_header                header;
+    struct replay_act_list              acts;
+    struct replay_checkpoint_list       checkpoints;
+    uint8_t                            *data;
+    size_t                              len;
+};
+
+int replay_writer_open(struct replay_writer *writer, const char *path, struct replay_header header);
+int replay_writer_append(struct replay_writer *writer, struct act act, const struct game_state *after);
+void replay_writer_close(struct replay_writer *writer);
+
+int replay_load(struct replay *replay, const char *path);
+void replay_deinit(struct replay *replay);
+void replay_start(const struct replay *replay, struct game_state *game);
+int replay_seek(const struct replay *replay, struct game_state *game, int turn);
+int replay_restore_checkpoint(const struct replay *replay, const struct replay_checkpoint *checkpoint, struct game_state *game);
+int replay_verify(const struct replay *replay);
+
+#endif
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include "engine/system/time.h"
+#include "replay.h"
+
+#define REPLAYER_LOG_SIZE 8192
+
+static char replayer_log[REPLAYER_LOG_SIZE];
+
+static void replayer_print_usage(const char *exe)
+{
+    fprintf(stderr,
+            "usage: %s [-t turn] [-v] [-b repeat] replay...\n"
+            "  -t  print the state at the start of a turn, seeking from the nearest checkpoint\n"
+            "  -v  re-run each log from its seed and check every checkpoint against it\n"
+            "  -b  replay each log from its seed this many times and report throughput\n", exe);
+}
+
+static void replayer_print_state(const struct game_state *game)
+{
+    log_game_state(replayer_log, sizeof(replayer_log), game, 0);
+    printf("%s\n", replayer_log);
+}
+
+/* Recorded games as a workload: every act goes through game_state_act again */
+static void replayer_bench(const struct replay *replay, int repeat)
+{
+    struct game_state game;
+    double start, elapsed_full, elapsed_seek;
+    long   acts = 0;
+    int    i, j, last_turn;
+
+    game_state_init(&game);
+    start = get_monotonic_time();
+    for (i = 0; i < repeat; i++) {
+        replay_start(replay, &game);
+        for (j = 0; j < replay->acts.len; j++)
+            acts += game_state_act(&game, replay->acts.elems[j]) == 0;
+    }
+    elapsed_full = get_monotonic_time() - start;
+    last_turn = game.turn;
+
+    start = get_monotonic_time();
+    for (i = 0; i < repeat; i++)
+        replay_seek(replay, &game, last_turn);
+    elapsed_seek = get_monotonic_time() - start;
+    game_state_deinit(&game);
+
+    printf("  replay     %.1f acts/s, %.2f us per full game\n",
+            acts / elapsed_full, elapsed_full * 1e6 / repeat);
+    printf("  seek       %.2f us to turn %d through checkpoints\n",
+            elapsed_seek * 1e6 / repeat, last_turn);
+}
+
+static int replayer_run(const char *path, int turn, char verify, int repeat)
+{
+    struct replay       replay;
+    struct game_state   game;
+    int                 res = 0, idx;
+
+    if (replay_load(&replay, path) != 0) {
+        replay_deinit(&replay);
+        return -1;
+    }
+    printf("%s: seed %llu, %d players, deal %d, %zu acts, %zu checkpoints\n",
+            path, (unsigned long long)replay.header.seed, replay.header.player_len, replay.header.deal,
+            replay.acts.len, replay.checkpoints.len);
+
+    if (verify) {
+        idx = replay_verify(&replay);
+        if (idx >= 0) {
+            printf("  checkpoint %d (act %u) doesn't match the rebuilt state\n",
+                    idx, replay.checkpoints.elems[idx].act_idx);
+            res = -1;
+        } else
+            printf("  all checkpoints match\n");
+    }
+
+    game_state_init(&game);
+    idx = replay_seek(&replay, &game, turn >= 0 ? turn : INT_MAX);
+    if (idx < 0) {
+        printf("  an act was rejected, the log doesn't fit these rules\n");
+        res = -1;
+    } else if (turn >= 0) {
+        replayer_print_state(&game);
+    } else {
+        printf("  %s after %d turns", game.ended ? "won" : "unfinished", game.turn);
+        if (game.ended)
+            printf(" by player %u", game.players[game.active_player_index].id);
+        printf("\n");
+    }
+    game_state_deinit(&game);
+
+    if (repeat > 0 && res == 0)
+        replayer_bench(&replay, repeat);
+
+    replay_deinit(&replay);
+    return res;
+}
+
+int main(int argc, char *argv[])
+{
+    int  turn = -1, repeat = 0, opt, i, res = 0;
+    char verify = 0;
+
+    while ((opt = getopt(argc, argv, "t:vb:h")) != -1) {
+        switch (opt) {
+            case 't': turn   = atoi(optarg); break;
+            case 'v': verify = 1; break;
+            case 'b': repeat = atoi(optarg); break;
+            default:
+                replayer_print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind == argc) {
+        replayer_print_usage(argv[0]);
+        return 1;
+    }
+
+    for (i = optind; i < argc; i++)
+        res |= replayer_run(argv[i], turn, verify, repeat) != 0;
+    return res;
+}
@@ -4,6 +4,7 @@
 #include "engine/system/network_packer.h"
 #include "engine/alias.h"
 #include "logic.h"
+#include "server.h"
 
 #ifndef __STDC_IEC_559__
 #include <float.h>
@@ -36,14 +37,23 @@ static inline void card_deserialize(struct card *card, u8 **cursor)
     card->type  = (s8)network_unpack_u8(cursor);
 }
 
-static inline size_t card_list_serialize(u8 **cursor, const struct card_list *cardlist)
+/* A hidden_idx of 0 or above redacts the list as that seat's hand, ids included,
+ * since an id alone names the card's face */
+static inline size_t card_list_serialize(u8 **cursor, const struct card_list *cardlist, int hidden_idx)
 {
+    struct card hidden;
     size_t total = 0;
     int i;
 
     total += network_pack_u16(cursor, cardlist->len);
-    for (i = 0; i < cardlist->len; i++)
-        total += card_serialize(cursor, cardlist->elems + i);
+    for (i = 0; i < cardlist->len; i++) {
+        hidden = cardlist->elems[i];
+        if (hidden_idx >= 0) {
+            CARD_HIDE(hidden);
+            hidden.id = CARD_ID_HIDDEN(hidden_idx, i);
+        }
+        total += card_serialize(cursor, &hidden);
+    }
     return total;
 }
 
@@ -63,12 +73,12 @@ static inline void cardlist_deserialize(struct card_list *cardlist, u8 **cursor)
         card_deserialize(cardlist->elems + i, cursor);
 }
 
-static inline size_t player_serialize(u8 **cursor, const struct player *player)
+static inline size_t player_serialize(u8 **cursor, const struct player *player, int hidden_idx)
 {
     size_t total = 0;
     total += network_pack_u8(cursor, player->id);
     total += network_pack_str(cursor, player->name);
-    total += card_list_serialize(cursor, &player->hand);
+    total += card_list_serialize(cursor, &player->hand, hidden_idx);
     return total;
 }
 
@@ -79,7 +89,123 @@ static inline void player_deserialize(struct player *player, u8 **cursor)
     cardlist_deserialize(&player->hand, cursor);
 }
 
-static inline size_t game_state_serialize(u8 **cursor, const struct game_state *state)
+/* Compact (NETMSG_VER_COMPACT) cards fit type, color and number in one byte:
+ * numbers are color*10+num, other types follow from 50 in steps of 5 colors */
+#define CARD_PACKED_UNKNOWN 0xFF
+#define CARD_PACKED_SPECIAL 50
+
+static inline u8 card_pack(const struct card *card)
+{
+    const int COLOR_IDX = card->color + 1;
+
+    if (card->type == CARD_UNKNOWN)
+        return CARD_PACKED_UNKNOWN;
+    if (card->type == CARD_NUMBER)
+        return COLOR_IDX * 10 + card->num % 10;
+    return CARD_PACKED_SPECIAL + (card->type - 1) * (CARD_COLOR_MAX + 1) + COLOR_IDX;
+}
+
+static inline void card_unpack(struct card *card, u8 packed)
+{
+    if (packed == CARD_PACKED_UNKNOWN) {
+        CARD_HIDE(*card);
+        return;
+    }
+    if (packed < CARD_PACKED_SPECIAL) {
+        card->type  = CARD_NUMBER;
+        card->color = packed / 10 - 1;
+        card->num   = packed % 10;
+        return;
+    }
+    packed     -= CARD_PACKED_SPECIAL;
+    card->type  = packed / (CARD_COLOR_MAX + 1) + 1;
+    card->color = packed % (CARD_COLOR_MAX + 1) - 1;
+    card->num   = 0;
+}
+
+static inline size_t card_compact_serialize(u8 **cursor, const struct card *card)
+{
+    size_t total = 0;
+    total += network_pack_u16(cursor, card->id);
+    total += network_pack_u8(cursor, card_pack(card));
+    return total;
+}
+
+static inline void card_compact_deserialize(struct card *card, u8 **cursor)
+{
+    card->id = network_unpack_u16(cursor);
+    card_unpack(card, network_unpack_u8(cursor));
+}
+
+static inline size_t card_list_compact_serialize(u8 **cursor, const struct card_list *cardlist)
+{
+    size_t total = 0;
+    int i;
+
+    total += network_pack_u16(cursor, cardlist->len);
+    for (i = 0; i < cardlist->len; i++)
+        total += card_compact_serialize(cursor, cardlist->elems + i);
+    return total;
+}
+
+static inline void card_list_compact_deserialize(struct card_list *cardlist, u8 **cursor)
+{
+    int i, len = network_unpack_u16(cursor);
+
+    if (!cardlist->elems)
+        card_list_init(cardlist, len ? len : 1);
+    card_list_clear(cardlist);
+    card_list_emplace(cardlist, len);
+    for (i = 0; i < len; i++)
+        card_compact_deserialize(cardlist->elems + i, cursor);
+}
+
+/* Hidden hands only exist as a count on the compact wire */
+static inline void card_list_fill_hidden(struct card_list *cardlist, int player_idx, int len)
+{
+    int i;
+
+    if (!cardlist->elems)
+        card_list_init(cardlist, len ? len : 1);
+    card_list_clear(cardlist);
+    card_list_emplace(cardlist, len);
+    for (i = 0; i < len; i++) {
+        CARD_HIDE(cardlist->elems[i]);
+        cardlist->elems[i].id = CARD_ID_HIDDEN(player_idx, i);
+    }
+}
+
+static inline size_t player_compact_serialize(u8 **cursor, const struct player *player)
+{
+    const size_t NAME_LEN = strlen(player->name);
+    size_t total = 0;
+
+    total += network_pack_u8(cursor, player->id);
+    total += network_pack_u8(cursor, NAME_LEN);
+    if (cursor) {
+        memcpy(*cursor, player->name, NAME_LEN);
+        *cursor += NAME_LEN;
+    }
+    total += NAME_LEN;
+    total += network_pack_u16(cursor, player->hand.len);
+    return total;
+}
+
+static inline void player_compact_deserialize(struct player *player, int player_idx, u8 **cursor)
+{
+    size_t name_len;
+
+    player->id = network_unpack_u8(cursor);
+    name_len   = network_unpack_u8(cursor);
+    memcpy(player->name, *cursor, min(name_len, PLAYER_NAME_MAX - 1));
+    player->name[min(name_len, PLAYER_NAME_MAX - 1)] = '\0';
+    *cursor += name_len;
+    card_list_fill_hidden(&player->hand, player_idx, network_unpack_u16(cursor));
+}
+
+/* Public part of a snapshot, hands other than visible_idx go out redacted
+ * and -1 redacts every hand. Compact versions never carry a hand here */
+static inline size_t game_state_serialize(u8 **cursor, const struct game_state *state, int visible_idx, int version)
 {
     size_t total = 0;
     int i;
@@ -89,16 +215,23 @@ static inline size_t game_state_serialize(u8 **cursor, const struct game_state *
     total += network_pack_u8(cursor, state->ended);
     total += network_pack_u8(cursor, state->skip_pool);
     total += network_pack_u16(cursor, state->batsu_pool);
-    card_serialize(cursor, &state->top_card);
+    if (version >= NETMSG_VER_COMPACT)
+        total += card_compact_serialize(cursor, &state->top_card);
+    else
+        total += card_serialize(cursor, &state->top_card);
 
     total += network_pack_u8(cursor, state->player_len);
-    for (i = 0; i < state->player_len; i++)
-        total += player_serialize(cursor, state->players + i);
+    for (i = 0; i < state->player_len; i++) {
+        if (version >= NETMSG_VER_COMPACT)
+            total += player_compact_serialize(cursor, state->players + i);
+        else
+            total += player_serialize(cursor, state->players + i, i != visible_idx ? i : -1);
+    }
     total += network_pack_u8(cursor, state->active_player_index);
     return total;
 }
 
-static inline void game_state_deserialize(struct game_state *state, u8 **cursor)
+static inline void game_state_deserialize(struct game_state *state, u8 **cursor, int version)
 {
     int i;
 
@@ -107,14 +240,167 @@ static inline void game_state_deserialize(struct game_state *state, u8 **cursor)
     state->ended      = network_unpack_u8(cursor);
     state->skip_pool  = network_unpack_u8(cursor);
     state->batsu_pool = network_unpack_u16(cursor);
-    card_deserialize(&state->top_card, cursor);
+    if (version >= NETMSG_VER_COMPACT)
+        card_compact_deserialize(&state->top_card, cursor);
+    else
+        card_deserialize(&state->top_card, cursor);
 
     state->player_len = network_unpack_u8(cursor);
-    for (i = 0; i < state->player_len; i++)
-        player_deserialize(state->players + i, cursor);
+    if (state->player_len > PLAYER_MAX)
+        state->player_len = PLAYER_MAX;
+    for (i = 0; i < state->player_len; i++) {
+        if (version >= NETMSG_VER_COMPACT)
+            player_compact_deserialize(state->players + i, i, cursor);
+        else
+            player_deserialize(state->players + i, cursor);
+    }
     state->active_player_index = network_unpack_u8(cursor);
 }
 
+/* Public part of a delta, cards and ids go out redacted so removals match by
+ * position. Compact versions only carry how many cards each hand lost and gained */
+static inline size_t game_state_delta_serialize(u8 **cursor, const struct game_state_delta *delta, int version)
+{
+    const struct hand_delta *hand;
+    struct card hidden;
+    size_t total = 0;
+    int i, j;
+
+    total += network_pack_u8(cursor, delta->turn);
+    total += network_pack_u8(cursor, delta->turn_dir);
+    total += network_pack_u8(cursor, delta->ended);
+    total += network_pack_u8(cursor, delta->skip_pool);
+    total += network_pack_u16(cursor, delta->batsu_pool);
+    if (version >= NETMSG_VER_COMPACT)
+        total += card_compact_serialize(cursor, &delta->top_card);
+    else
+        total += card_serialize(cursor, &delta->top_card);
+    total += network_pack_u8(cursor, delta->active_player_index);
+
+    total += network_pack_u8(cursor, delta->player_len);
+    for (i = 0; i < delta->player_len; i++) {
+        hand = delta->hands + i;
+
+        total += network_pack_u16(cursor, hand->removed.len);
+        if (version < NETMSG_VER_COMPACT) {
+            for (j = 0; j < hand->removed.len; j++)
+                total += network_pack_u16(cursor, CARD_ID_UNKNOWN);
+        }
+
+        total += network_pack_u16(cursor, hand->added.len);
+        if (version < NETMSG_VER_COMPACT) {
+            for (j = 0; j < hand->added.len; j++) {
+                hidden = hand->added.elems[j];
+                CARD_HIDE(hidden);
+                hidden.id = CARD_ID_UNKNOWN;
+                total += card_serialize(cursor, &hidden);
+            }
+        }
+    }
+    return total;
+}
+
+static inline void game_state_delta_deserialize(struct game_state_delta *delta, u8 **cursor, int version)
+{
+    struct hand_delta *hand;
+    int i, j, len;
+
+    delta->turn       = network_unpack_u8(cursor);
+    delta->turn_dir   = (s8)network_unpack_u8(cursor);
+    delta->ended      = network_unpack_u8(cursor);
+    delta->skip_pool  = network_unpack_u8(cursor);
+    delta->batsu_pool = network_unpack_u16(cursor);
+    if (version >= NETMSG_VER_COMPACT)
+        card_compact_deserialize(&delta->top_card, cursor);
+    else
+        card_deserialize(&delta->top_card, cursor);
+    delta->active_player_index = network_unpack_u8(cursor);
+
+    delta->player_len = network_unpack_u8(cursor);
+    if (delta->player_len > PLAYER_MAX)
+        delta->player_len = PLAYER_MAX;
+    for (i = 0; i < delta->player_len; i++) {
+        hand = delta->hands + i;
+
+        len = network_unpack_u16(cursor);
+        card_id_list_clear(&hand->removed);
+        card_id_list_emplace(&hand->removed, len);
+        for (j = 0; j < len; j++)
+            hand->removed.elems[j] = version >= NETMSG_VER_COMPACT ? CARD_ID_UNKNOWN : network_unpack_u16(cursor);
+
+        len = network_unpack_u16(cursor);
+        card_list_clear(&hand->added);
+        card_list_emplace(&hand->added, len);
+        for (j = 0; j < len; j++) {
+            if (version < NETMSG_VER_COMPACT) {
+                card_deserialize(hand->added.elems + j, cursor);
+                continue;
+            }
+            CARD_HIDE(hand->added.elems[j]);
+            hand->added.elems[j].id = CARD_ID_UNKNOWN;
+        }
+    }
+}
+
+/* Private segments follow the shared public part and carry the owner's cards */
+static inline size_t game_state_private_serialize(u8 **cursor, const struct game_state *state, int idx, int version)
+{
+    size_t total = 0;
+    total += network_pack_u8(cursor, idx);
+    if (version >= NETMSG_VER_COMPACT)
+        total += card_list_compact_serialize(cursor, &state->players[idx].hand);
+    else
+        total += card_list_serialize(cursor, &state->players[idx].hand, -1);
+    return total;
+}
+
+static inline void game_state_private_deserialize(struct game_state *state, u8 **cursor, int version)
+{
+    int idx = network_unpack_u8(cursor);
+    struct card_list *hand = &state->players[idx < PLAYER_MAX ? idx : 0].hand;
+
+    if (version >= NETMSG_VER_COMPACT)
+        card_list_compact_deserialize(hand, cursor);
+    else
+        cardlist_deserialize(hand, cursor);
+}
+
+static inline size_t game_state_delta_private_serialize(u8 **cursor, const struct game_state_delta *delta, int idx, int version)
+{
+    const struct hand_delta *hand = delta->hands + idx;
+    size_t total = 0;
+    int i;
+
+    total += network_pack_u8(cursor, idx);
+    total += network_pack_u16(cursor, hand->removed.len);
+    for (i = 0; i < hand->removed.len; i++)
+        total += network_pack_u16(cursor, hand->removed.elems[i]);
+    if (version >= NETMSG_VER_COMPACT)
+        total += card_list_compact_serialize(cursor, &hand->added);
+    else
+        total += card_list_serialize(cursor, &hand->added, -1);
+    return total;
+}
+
+/* Reveals the owner's side of what the public part redacted */
+static inline void game_state_delta_private_deserialize(struct game_state_delta *delta, u8 **cursor, int version)
+{
+    struct hand_delta *hand;
+    int i, len, idx;
+
+    idx  = network_unpack_u8(cursor);
+    hand = delta->hands + (idx < PLAYER_MAX ? idx : 0);
+    len  = network_unpack_u16(cursor);
+    card_id_list_clear(&hand->removed);
+    card_id_list_emplace(&hand->removed, len);
+    for (i = 0; i < len; i++)
+        hand->removed.elems[i] = network_unpack_u16(cursor);
+    if (version >= NETMSG_VER_COMPACT)
+        card_list_compact_deserialize(&hand->added, cursor);
+    else
+        cardlist_deserialize(&hand->added, cursor);
+}
+
 static inline size_t act_serialize(u8 **cursor, struct act act)
 {
     size_t total = 0;
@@ -144,4 +430,16 @@ static inline struct act act_deserialize(u8 **cursor)
     }
     return act;
 }
+
+static inline size_t lobby_join_serialize(u8 **cursor, struct lobby_join join)
+{
+    return network_pack_u8(cursor, join.seats);
+}
+
+static inline struct lobby_join lobby_join_deserialize(u8 **cursor)
+{
+    struct lobby_join join;
+    join.seats = network_unpack_u8(cursor);
+    return join;
+}
 #endif
@@ -1,165 +1,814 @@
+#include <stdlib.h>
+#include <time.h>
 #include "engine/system/network.h"
 #include "engine/system/time.h"
+#include "engine/system/log.h"
 #include "serialize.h"
+#include "replay.h"
 #include "server.h"
 #include "logic.h"
 
+#define TABLE_CHUNK_LEN     64
+#define CONN_RECV_SIZE      64
+#define LISTEN_BACKLOG      128
+#define SERVER_EVENTS_MAX   256
+
+#define pconn_is_local(pconn)   (!(pconn)->conn && (pconn)->recvmsg)
+#define pconn_is_remote(pconn)  ((pconn)->conn != NULL)
+#define pconn_is_vacant(pconn)  (!(pconn)->conn && !(pconn)->recvmsg)
+
+#define TABLE_ACTIVE_ID(table)  ((table)->state.players[(table)->state.active_player_index].id)
+
+struct server_table {
+    struct game_state             state;
+    struct player_connection      conns[PLAYER_MAX];
+    int                           conn_len;
+    int                           max_player;
+    char                          started;
+    char                          touched;
+
+    /* What remotes last saw, acts go out as the diff against it */
+    struct game_state             broadcast_state;
+    struct game_state_delta       delta;
+    uint32_t                      seq;
+
+    struct replay_writer          replay;
+
+    int                           id;
+    size_t                        active_idx;
+    struct server_table          *next_free;
+};
+DEFINE_ARRAY_LIST_WRAPPER(static, struct server_table *, table_list)
+
+struct server_table_pool {
+    struct server_table         **chunks;
+    size_t                        chunk_len;
+    struct server_table          *free_list;
+
+    struct table_list             active;
+    struct table_list             open;
+};
+
+/* pconn stays first so poller userdata can be cast back to the entry */
+struct lobby_entry {
+    struct player_connection      pconn;
+    size_t                        idx;
+};
+DEFINE_ARRAY_LIST_WRAPPER(static, struct lobby_entry *, lobby_list)
+
 struct network_listener      *server_listener;
-struct game_state             server_state = {0};
-struct player_connection      server_conns[PLAYER_MAX] = {0};
-int                           server_conn_len;
-char                          server_game_started = 0;
-struct network_buffer         server_recvbuff;
+struct network_poller        *server_poller;
+struct server_table_pool      server_tables = {0};
+struct table_list             server_touched;
+struct lobby_list             server_lobby;
+struct server_table          *server_local_table;
 
 int                           server_max_player;
+struct rng                    server_rng;
+const char                   *server_replay_dir;
 
-int server_register_local(void (*recvmsg)(short type, const void *data))
+/* TABLE POOL */
+static int table_pool_grow(struct server_table_pool *pool)
 {
-    if (server_game_started)
+    struct server_table **chunks;
+    struct server_table  *chunk;
+    int i;
+
+    chunks = realloc(pool->chunks, sizeof(struct server_table *) * (pool->chunk_len + 1));
+    if (!chunks)
+        return -1;
+    pool->chunks = chunks;
+
+    chunk = calloc(TABLE_CHUNK_LEN, sizeof(struct server_table));
+    if (!chunk)
         return -1;
-    server_conns[server_conn_len].conn = NULL;
-    server_conns[server_conn_len].recvmsg = recvmsg;
-    server_conn_len++;
+
+    for (i = TABLE_CHUNK_LEN - 1; i >= 0; i--) {
+        chunk[i].id         = pool->chunk_len * TABLE_CHUNK_LEN + i;
+        chunk[i].next_free  = pool->free_list;
+        pool->free_list     = chunk + i;
+    }
+    pool->chunks[pool->chunk_len++] = chunk;
     return 0;
 }
 
-void server_broadcast_game_start()
+static struct server_table *table_pool_acquire(struct server_table_pool *pool, int max_player)
+{
+    struct server_table *table;
+
+    if (!pool->free_list && table_pool_grow(pool) != 0) {
+        cuno_logf(LOG_ERR, "SERVER: Table pool exhausted");
+        return NULL;
+    }
+    table           = pool->free_list;
+    pool->free_list = table->next_free;
+
+    /* The delta lists outlive the table, so recycled slots skip the allocation */
+    if (!table->delta.hands[0].added.elems)
+        game_state_delta_init(&table->delta);
+
+    game_state_init(&table->state);
+    game_state_init(&table->broadcast_state);
+    table->seq          = 0;
+    table->conn_len     = 0;
+    table->max_player   = min(max_player, PLAYER_MAX);
+    table->started      = 0;
+    table->touched      = 0;
+    table->next_free    = NULL;
+
+    table->active_idx   = pool->active.len;
+    *table_list_emplace(&pool->active, 1) = table;
+    *table_list_emplace(&pool->open, 1) = table;
+    return table;
+}
+
+static void table_list_remove_ptr(struct table_list *list, const struct server_table *table)
+{
+    size_t i;
+    for (i = 0; i < list->len; i++) {
+        if (list->elems[i] == table) {
+            list->elems[i] = list->elems[--list->len];
+            return;
+        }
+    }
+}
+
+/* Drains the send queue on writability and fills the receive buffer on readability */
+static enum network_result pconn_service(struct player_connection *pconn, char ready)
+{
+    enum network_result res = NETRES_SUCCESS;
+
+    if ((ready & NETWORK_POLLOUT) && NETWORK_SENDQ_LEN(pconn->sendq))
+        res = network_connection_sendq(pconn->conn, &pconn->sendq);
+    if (res < NETRES_ERR_CONN && (ready & NETWORK_POLLIN))
+        res = network_connection_sendrecv(pconn->conn, NULL, &pconn->recvbuff, NETWORK_POLLIN);
+    return res;
+}
+
+static void pconn_drop(struct player_connection *pconn)
+{
+    network_poller_remove_connection(server_poller, pconn->conn);
+    network_connection_destroy(pconn->conn);
+    network_sendq_deinit(&pconn->sendq);
+    network_buffer_deinit(&pconn->recvbuff);
+    pconn->conn = NULL;
+}
+
+static void table_pool_release(struct server_table_pool *pool, struct server_table *table)
+{
+    struct server_table *moved;
+    int i;
+
+    for (i = 0; i < table->conn_len; i++) {
+        if (pconn_is_remote(table->conns + i))
+            pconn_drop(table->conns + i);
+    }
+    replay_writer_close(&table->replay);
+    if (table->started) {
+        game_state_deinit(&table->state);
+        game_state_deinit(&table->broadcast_state);
+    } else
+        table_list_remove_ptr(&pool->open, table);
+
+    moved = pool->active.elems[--pool->active.len];
+    pool->active.elems[table->active_idx] = moved;
+    moved->active_idx = table->active_idx;
+
+    table->next_free = pool->free_list;
+    pool->free_list  = table;
+}
+
+/* TABLE */
+static void table_touch(struct server_table *table)
+{
+    if (table->touched)
+        return;
+    table->touched = 1;
+    *table_list_emplace(&server_touched, 1) = table;
+}
+
+/* Header and private bytes share one small payload wrapped around the public one */
+static void pconn_queue_split(struct player_connection *pconn, struct network_payload *public, struct network_payload *private)
+{
+    network_sendq_push(&pconn->sendq, private, 0, NETHDR_SERIALIZED_SIZE);
+    network_sendq_push(&pconn->sendq, public, 0, public->len);
+    network_sendq_push(&pconn->sendq, private, NETHDR_SERIALIZED_SIZE, private->len - NETHDR_SERIALIZED_SIZE);
+}
+
+static void table_broadcast_game_start(struct server_table *table)
 {
     struct network_header header = {
-        .version = NETMSG_VER,
-        .type = MSG_GM_START
+        .type = MSG_GM_START,
+        .len = sizeof(uint8_t),
     };
+    struct network_payload *payload;
+    uint8_t *cursor;
     int i;
 
-    for (i = 0; i < server_conn_len; i++) {
-        if (!server_conns[i].conn) {
-            server_conns[i].recvmsg(header.type, &server_conns[i].player_id);
+    for (i = 0; i < table->conn_len; i++) {
+        if (pconn_is_local(table->conns + i)) {
+            table->conns[i].recvmsg(header.type, &table->conns[i].player_id);
             continue;
         }
-        
-        header.len = sizeof(uint8_t);
+        if (!pconn_is_remote(table->conns + i))
+            continue;
 
-        network_buffer_make_space(&server_conns[i].sendbuff, header.len + NETHDR_SERIALIZED_SIZE);
+        payload = network_payload_create(NETHDR_SERIALIZED_SIZE + header.len);
+        if (!payload)
+            continue;
 
-        network_header_serialize(&server_conns[i].sendbuff.tail, &header);
-        network_pack_u8(&server_conns[i].sendbuff.tail, server_conns[i].player_id);
+        header.version = table->conns[i].version;
+        cursor = payload->data;
+        network_header_serialize(&cursor, &header);
+        network_pack_u8(&cursor, table->conns[i].player_id);
+        network_sendq_push(&table->conns[i].sendq, payload, 0, payload->len);
+        network_payload_release(payload);
     }
+    table_touch(table);
 }
 
-void server_broadcast_state()
+static void table_send_local_snapshot(struct server_table *table, struct player_connection *pconn)
 {
     struct game_state temp;
+
+    game_state_init(&temp);
+    game_state_copy_into(&temp, &table->state);
+    game_state_for_player(&temp, pconn->player_id);
+    pconn->recvmsg(MSG_GM_STATE, &temp);
+    game_state_deinit(&temp);
+}
+
+static struct network_payload *table_encode_public_state(struct server_table *table, int version)
+{
+    struct network_payload *public;
+    uint8_t *cursor;
+
+    public = network_payload_create(sizeof(uint32_t) + game_state_serialize(NULL, &table->state, -1, version));
+    if (!public)
+        return NULL;
+
+    cursor = public->data;
+    network_pack_u32(&cursor, table->seq);
+    game_state_serialize(&cursor, &table->state, -1, version);
+    return public;
+}
+
+static struct network_payload *table_encode_public_delta(struct server_table *table, int version)
+{
+    struct network_payload *public;
+    uint8_t *cursor;
+
+    public = network_payload_create(sizeof(uint32_t) + game_state_delta_serialize(NULL, &table->delta, version));
+    if (!public)
+        return NULL;
+
+    cursor = public->data;
+    network_pack_u32(&cursor, table->seq);
+    game_state_delta_serialize(&cursor, &table->delta, version);
+    return public;
+}
+
+static void table_send_state(struct server_table *table, struct player_connection *pconn, struct network_payload *public)
+{
     struct network_header header = {
-        .version = NETMSG_VER,
+        .version = pconn->version,
         .type = MSG_GM_STATE,
-        .len = 0,
     };
-    int i;
+    struct network_payload *private;
+    uint8_t *cursor;
+    int idx = find_player_idx(&table->state, pconn->player_id);
+    size_t private_len = game_state_private_serialize(NULL, &table->state, idx, pconn->version);
 
+    private = network_payload_create(NETHDR_SERIALIZED_SIZE + private_len);
+    if (!private)
+        return;
 
-    game_state_init(&temp);
-    for (i = 0; i < server_conn_len; i++) {
-        game_state_copy_into(&temp, &server_state);
-        game_state_for_player(&temp, server_conns[i].player_id);
+    header.len = public->len + private_len;
+    cursor = private->data;
+    network_header_serialize(&cursor, &header);
+    game_state_private_serialize(&cursor, &table->state, idx, pconn->version);
+
+    pconn_queue_split(pconn, public, private);
+    network_payload_release(private);
+}
+
+static void table_send_delta(struct server_table *table, struct player_connection *pconn, struct network_payload *public)
+{
+    struct network_header header = {
+        .version = pconn->version,
+        .type = MSG_GM_DELTA,
+    };
+    struct network_payload *private;
+    uint8_t *cursor;
+    int idx = find_player_idx(&table->state, pconn->player_id);
+    size_t private_len = game_state_delta_private_serialize(NULL, &table->delta, idx, pconn->version);
+
+    private = network_payload_create(NETHDR_SERIALIZED_SIZE + private_len);
+    if (!private)
+        return;
+
+    header.len = public->len + private_len;
+    cursor = private->data;
+    network_header_serialize(&cursor, &header);
+    game_state_delta_private_serialize(&cursor, &table->delta, idx, pconn->version);
+
+    pconn_queue_split(pconn, public, private);
+    network_payload_release(private);
+}
+
+static void table_resync(struct server_table *table, struct player_connection *pconn)
+{
+    struct network_payload *public;
+
+    if (pconn_is_local(pconn)) {
+        table_send_local_snapshot(table, pconn);
+        return;
+    }
+    public = table_encode_public_state(table, pconn->version);
+    if (!public)
+        return;
 
-        if (!server_conns[i].conn) {
-            server_conns[i].recvmsg(header.type, &temp);
+    table_send_state(table, pconn, public);
+    network_payload_release(public);
+    table_touch(table);
+}
+
+/* Public parts are encoded once per wire version present at the table */
+static void table_broadcast(struct server_table *table, char delta)
+{
+    struct network_payload   *public[NETMSG_VER_MAX + 1] = {0};
+    struct player_connection *pconn;
+    int i;
+
+    for (i = 0; i < table->conn_len; i++) {
+        pconn = table->conns + i;
+        if (pconn_is_local(pconn)) {
+            table_send_local_snapshot(table, pconn);
             continue;
         }
+        if (!pconn_is_remote(pconn))
+            continue;
 
-        header.len = game_state_serialize(NULL, &temp);
-        network_buffer_make_space(&server_conns[i].sendbuff, NETHDR_SERIALIZED_SIZE + header.len);
+        if (!public[pconn->version])
+            public[pconn->version] = delta ? table_encode_public_delta(table, pconn->version)
+                                           : table_encode_public_state(table, pconn->version);
+        if (!public[pconn->version])
+            continue;
 
-        network_header_serialize(&server_conns[i].sendbuff.tail, &header);
-        game_state_serialize(&server_conns[i].sendbuff.tail, &temp);
+        if (delta)
+            table_send_delta(table, pconn, public[pconn->version]);
+        else
+            table_send_state(table, pconn, public[pconn->version]);
+    }
+    for (i = 0; i <= NETMSG_VER_MAX; i++) {
+        if (public[i])
+            network_payload_release(public[i]);
     }
+    table_touch(table);
 }
 
-int server_handle_act(struct act act)
+static void table_broadcast_state(struct server_table *table)
+{
+    game_state_copy_into(&table->broadcast_state, &table->state);
+    table_broadcast(table, 0);
+}
+
+/* Local players keep their snapshot callback, remotes only get what changed */
+static void table_broadcast_delta(struct server_table *table)
+{
+    game_state_diff(&table->delta, &table->broadcast_state, &table->state);
+    game_state_copy_into(&table->broadcast_state, &table->state);
+    table->seq++;
+    table_broadcast(table, 1);
+}
+
+static int table_handle_act(struct server_table *table, struct act act)
 {
-    int res = game_state_act(&server_state, act);
-    if (res == 0)
-        server_broadcast_state();
+    int res = game_state_act(&table->state, act);
+    if (res != 0)
+        return res;
+
+    if (table->replay.file)
+        replay_writer_append(&table->replay, act, &table->state);
+    /* The host's own table is never released before exit, so the log can't wait for that */
+    if (table->state.ended)
+        replay_writer_close(&table->replay);
+    table_broadcast_delta(table);
     return res;
 }
 
-void server_process_recvbuff()
+static int table_count_connected(const struct server_table *table)
+{
+    int i, count = 0;
+    for (i = 0; i < table->conn_len; i++) {
+        if (pconn_is_local(table->conns + i))
+            return -1;
+        count += pconn_is_remote(table->conns + i);
+    }
+    return count;
+}
+
+/* A dropped seat can't act anymore, its turns end with a draw so the rest play on.
+ * Every vacant seat takes at most a draw and an end turn before a seated one is up */
+static void table_pass_vacant_turns(struct server_table *table)
+{
+    struct act act = {0};
+    int i;
+
+    for (i = 0; i < 2 * table->conn_len; i++) {
+        if (table->state.ended || table_count_connected(table) == 0
+                || !pconn_is_vacant(table->conns + table->state.active_player_index))
+            return;
+
+        act.type = table->state.curr_act ? ACT_END_TURN : ACT_DRAW;
+        if (table_handle_act(table, act) != 0)
+            return;
+    }
+}
+
+static void table_start_game(struct server_table *table)
+{
+    const int INITIAL_DEAL = 5;
+    const uint64_t SEED = rng_next64(&server_rng);
+    char path[512];
+    int i;
+
+    cuno_logf(LOG_INFO, "SERVER: table %d starts with seed %llu", table->id, (unsigned long long)SEED);
+    game_state_start(&table->state, table->conn_len, INITIAL_DEAL, SEED);
+    if (server_replay_dir) {
+        snprintf(path, sizeof(path), "%s/%016llx.cunorep", server_replay_dir, (unsigned long long)SEED);
+        replay_writer_open(&table->replay, path, (struct replay_header){ SEED, table->conn_len, INITIAL_DEAL });
+    }
+    for (i = 0; i < table->conn_len; i++)
+        table->conns[i].player_id = table->state.players[i].id;
+
+    table->started = 1;
+    table_list_remove_ptr(&server_tables.open, table);
+    table_broadcast_game_start(table);
+    table_broadcast_state(table);
+}
+
+static struct player_connection *table_find_vacant_seat(struct server_table *table)
+{
+    int i;
+    for (i = 0; i < table->conn_len; i++) {
+        if (pconn_is_vacant(table->conns + i))
+            return table->conns + i;
+    }
+    return NULL;
+}
+
+/* Seats left by dropped remotes are closed before the game deals them a hand.
+ * Moved seats are userdata to the poller, so this only runs between waits */
+static void table_release_vacant_seats(struct server_table *table)
+{
+    struct player_connection *seat;
+    int i, len = 0;
+
+    for (i = 0; i < table->conn_len; i++) {
+        if (pconn_is_vacant(table->conns + i))
+            continue;
+
+        seat = table->conns + len++;
+        if (seat == table->conns + i)
+            continue;
+        *seat = table->conns[i];
+        if (pconn_is_remote(seat))
+            network_poller_modify_connection(server_poller, seat->conn,
+                    NETWORK_POLLIN | (NETWORK_SENDQ_LEN(seat->sendq) ? NETWORK_POLLOUT : 0), seat);
+    }
+    table->conn_len = len;
+}
+
+/* Vacant seats are refilled in place, nothing moves while events are pending */
+static struct player_connection *table_seat(struct server_table *table, const struct player_connection *pconn)
+{
+    struct player_connection *seat;
+
+    if (table->started)
+        return NULL;
+
+    seat = table_find_vacant_seat(table);
+    if (!seat && table->conn_len >= table->max_player)
+        return NULL;
+    if (!seat)
+        seat = table->conns + table->conn_len++;
+    *seat = *pconn;
+    seat->table = table;
+    if (pconn_is_remote(seat))
+        network_poller_modify_connection(server_poller, seat->conn, NETWORK_POLLIN, seat);
+
+    if (table->conn_len >= table->max_player && !table_find_vacant_seat(table))
+        table_start_game(table);
+    table_touch(table);
+    return seat;
+}
+
+/* Frames are only trusted from the seat whose turn it is.
+ * A malformed frame drops the connection, its bytes can't be trusted for anything after */
+static void table_process_frame(struct server_table *table, struct player_connection *pconn)
 {
     static int printed = 0;
     struct network_header header;
-    struct act act;
+    struct act act = {0};
+    uint8_t *frame_end;
 
-    if (!network_buffer_peek_hdrmsg(&server_recvbuff))
-        return;
+    network_header_deserialize(&header, &pconn->recvbuff.head);
+    frame_end = pconn->recvbuff.head + header.len;
 
-    network_header_deserialize(&header, &server_recvbuff.head);
     switch (header.type) {
         case MSG_GM_ACT:
-            act = act_deserialize(&server_recvbuff.head);
-            server_handle_act(act);
-            return;
+            if (header.len)
+                act.type = *pconn->recvbuff.head;
+            if (!header.len || header.len != act_serialize(NULL, act)) {
+                cuno_logf(LOG_WARN, "SERVER: Malformed act of %u bytes, dropping the seat", header.len);
+                pconn_drop(pconn);
+                table_touch(table);
+                return;
+            }
+            act = act_deserialize(&pconn->recvbuff.head);
+            if (table->started && TABLE_ACTIVE_ID(table) == pconn->player_id)
+                table_handle_act(table, act);
+            break;
+        case MSG_GM_RESYNC:
+            if (table->started)
+                table_resync(table, pconn);
+            break;
         default:
             if (printed)
                 break;
             printed = 1;
             printf("Header received: len %d type %d\n", header.len, header.type);
+            break;
+    }
+    pconn->recvbuff.head = frame_end;
+}
+
+static int table_is_idling(const struct server_table *table)
+{
+    int i;
+    for (i = 0; i < table->conn_len; i++) {
+        if (pconn_is_remote(table->conns + i) && NETWORK_SENDQ_LEN(table->conns[i].sendq))
+            return 0;
+    }
+    return 1;
+}
+
+static int table_is_finished(const struct server_table *table)
+{
+    int connected = table_count_connected(table);
+
+    if (connected < 0)
+        return 0;
+    return connected == 0 || (table->state.ended && table_is_idling(table));
+}
+
+static void table_on_ready(struct player_connection *pconn, char ready)
+{
+    struct server_table *table = pconn->table;
+
+    if (pconn_service(pconn, ready) >= NETRES_ERR_CONN) {
+        pconn_drop(pconn);
+        table_touch(table);
+        return;
+    }
+
+    while (pconn->conn && network_buffer_peek_hdrmsg(&pconn->recvbuff))
+        table_process_frame(table, pconn);
+    table_touch(table);
+}
+
+/* Sends optimistically, only sockets left with a backlog wait for writability.
+ * Returns how many connections were dropped on the way */
+static int table_flush(struct server_table *table)
+{
+    struct player_connection *pconn;
+    int i, dropped = 0;
+
+    for (i = 0; i < table->conn_len; i++) {
+        pconn = table->conns + i;
+        if (!pconn_is_remote(pconn) || !NETWORK_SENDQ_LEN(pconn->sendq))
+            continue;
+
+        if (pconn_service(pconn, NETWORK_POLLOUT) >= NETRES_ERR_CONN) {
+            pconn_drop(pconn);
+            dropped++;
+            continue;
+        }
+        network_poller_watch_connection(server_poller, pconn->conn,
+                NETWORK_POLLIN | (NETWORK_SENDQ_LEN(pconn->sendq) ? NETWORK_POLLOUT : 0), pconn);
+    }
+    return dropped;
+}
+
+/* LOBBY */
+static struct server_table *lobby_find_open_table(int seats)
+{
+    struct server_table *table;
+    size_t i;
+
+    for (i = 0; i < server_tables.open.len; i++) {
+        table = server_tables.open.elems[i];
+        if (!seats || table->max_player == seats)
+            return table;
+    }
+    return table_pool_acquire(&server_tables, seats ? seats : server_max_player);
+}
+
+static void lobby_remove(struct lobby_entry *entry, char keep_conn)
+{
+    if (!keep_conn)
+        pconn_drop(&entry->pconn);
+
+    server_lobby.elems[entry->idx] = server_lobby.elems[--server_lobby.len];
+    server_lobby.elems[entry->idx]->idx = entry->idx;
+    free(entry);
+}
+
+static void lobby_on_ready(struct lobby_entry *entry, char ready)
+{
+    struct network_header     header;
+    struct lobby_join         join = {0};
+    struct server_table      *table;
+    struct player_connection *pconn;
+    uint8_t                  *frame_end;
+
+    if (pconn_service(&entry->pconn, ready) >= NETRES_ERR_CONN) {
+        lobby_remove(entry, 0);
+        return;
+    }
+
+    while (network_buffer_peek_hdrmsg(&entry->pconn.recvbuff)) {
+        network_header_deserialize(&header, &entry->pconn.recvbuff.head);
+        frame_end = entry->pconn.recvbuff.head + header.len;
+        if (header.type != MSG_LB_JOIN) {
+            entry->pconn.recvbuff.head = frame_end;
+            continue;
+        }
+        if (header.len != lobby_join_serialize(NULL, join)) {
+            cuno_logf(LOG_WARN, "SERVER: Malformed join of %u bytes, dropping the connection", header.len);
+            lobby_remove(entry, 0);
+            return;
+        }
+
+        join  = lobby_join_deserialize(&entry->pconn.recvbuff.head);
+        entry->pconn.recvbuff.head = frame_end;
+        entry->pconn.version = min(header.version, NETMSG_VER_MAX);
+        /* 0 lets the server pick, a table needs at least two seats to be a game */
+        if (join.seats)
+            join.seats = max(2, min(join.seats, PLAYER_MAX));
+        table = lobby_find_open_table(join.seats);
+        if (!table) {
+            cuno_logf(LOG_ERR, "SERVER: No table for a join, dropping the connection");
+            lobby_remove(entry, 0);
             return;
+        }
+
+        /* Anything pipelined after the join now belongs to the seat */
+        pconn = table_seat(table, &entry->pconn);
+        lobby_remove(entry, 1);
+        while (pconn && pconn->conn && network_buffer_peek_hdrmsg(&pconn->recvbuff))
+            table_process_frame(table, pconn);
+        return;
     }
 }
 
-void server_init(int port, int max_players)
+static void lobby_accept_pending()
 {
-    network_buffer_init(&server_recvbuff, 64 * max_players);
-    game_state_init(&server_state);
-    server_listener = network_listener_create(port, max_players);
-    server_max_player = max_players;
+    struct network_connection *conn;
+    struct lobby_entry        *entry;
+
+    while ((conn = network_listener_accept(server_listener))) {
+        entry = malloc(sizeof(struct lobby_entry));
+        if (!entry) {
+            network_connection_destroy(conn);
+            return;
+        }
+
+        entry->pconn.conn      = conn;
+        entry->pconn.player_id = -1;
+        entry->pconn.recvmsg   = NULL;
+        entry->pconn.table     = NULL;
+        entry->pconn.version   = NETMSG_VER;
+        network_sendq_init(&entry->pconn.sendq, 8);
+        network_buffer_init(&entry->pconn.recvbuff, CONN_RECV_SIZE);
+
+        entry->idx = server_lobby.len;
+        *lobby_list_emplace(&server_lobby, 1) = entry;
+        network_poller_add_connection(server_poller, conn, NETWORK_POLLIN, &entry->pconn);
+    }
 }
 
-void server_start_game()
+/* SERVER */
+int server_register_local(void (*recvmsg)(short type, const void *data))
 {
-    const int INITIAL_DEAL = 5;
-    int i;
+    struct player_connection pconn = {0};
 
-    srand(get_monotonic_time());
-    game_state_start(&server_state, server_conn_len, INITIAL_DEAL);
-    for (i = 0; i < server_conn_len; i++)
-        server_conns[i].player_id = server_state.players[i].id;
+    if (!server_local_table)
+        server_local_table = lobby_find_open_table(server_max_player);
+    if (!server_local_table || server_local_table->started)
+        return -1;
 
-    server_game_started = 1;
-    server_broadcast_game_start();
-    server_broadcast_state();
+    pconn.conn = NULL;
+    pconn.recvmsg = recvmsg;
+    return table_seat(server_local_table, &pconn) ? 0 : -1;
 }
 
-void server_update()
+int server_handle_act(struct act act)
 {
-    int i;
-    uint8_t *temp;
+    if (!server_local_table)
+        return -1;
+    return table_handle_act(server_local_table, act);
+}
 
-    if (!server_game_started && network_listener_poll(server_listener)) {
-        server_conns[server_conn_len].conn = network_listener_accept(server_listener);
-        network_buffer_init(&server_conns[server_conn_len].sendbuff, 1024);
-        server_conn_len++;
+void server_init(int port, int max_players)
+{
+    rng_seed(&server_rng, (uint64_t)time(NULL) << 32 ^ (uint64_t)(get_monotonic_time() * 1e9), 0);
+    table_list_init(&server_tables.active, TABLE_CHUNK_LEN);
+    table_list_init(&server_tables.open, 8);
+    table_list_init(&server_touched, TABLE_CHUNK_LEN);
+    lobby_list_init(&server_lobby, 8);
+
+    server_poller = network_poller_create();
+    server_listener = network_listener_create(port, LISTEN_BACKLOG);
+    if (server_poller && server_listener)
+        network_poller_add_listener(server_poller, server_listener, server_listener);
+    server_max_player = max_players;
+}
+
+/* Every table started afterwards logs its game to <dir>/<seed>.cunorep */
+void server_set_replay_dir(const char *dir)
+{
+    server_replay_dir = dir;
+}
 
-        if (server_conn_len >= server_max_player)
-            server_start_game();
+void server_start_game()
+{
+    if (server_local_table && !server_local_table->started) {
+        table_release_vacant_seats(server_local_table);
+        table_start_game(server_local_table);
     }
+}
+
+void server_update(int timeout_ms)
+{
+    struct network_event     events[SERVER_EVENTS_MAX];
+    struct player_connection *pconn;
+    struct server_table      *table;
+    int i, ready;
+
+    if (!server_poller)
+        return;
+
+    /* Work queued outside an update (local acts) must not sit behind a blocking wait */
+    if (server_touched.len)
+        timeout_ms = 0;
 
-    for (i = 0; i < server_conn_len; i++) {
-        if (!server_conns[i].conn)
+    ready = network_poller_wait(server_poller, events, SERVER_EVENTS_MAX, timeout_ms);
+    for (i = 0; i < ready; i++) {
+        if (events[i].userdata == server_listener) {
+            lobby_accept_pending();
             continue;
+        }
+
+        pconn = events[i].userdata;
+        if (pconn->table)
+            table_on_ready(pconn, events[i].flags);
+        else
+            lobby_on_ready((struct lobby_entry *)pconn, events[i].flags);
+    }
 
-        network_connection_sendrecv_nb(server_conns[i].conn, &server_conns[i].sendbuff, &server_recvbuff);
+    /* Tables stay marked touched while their broadcasts are flushed, so passing
+     * turns of seats dropped on the way doesn't queue them again */
+    for (i = 0; i < server_touched.len; i++) {
+        table = server_touched.elems[i];
 
-        while (NETWORK_BUFFER_LEN(server_recvbuff))
-            server_process_recvbuff();
+        if (!table->started) {
+            table_release_vacant_seats(table);
+            table_flush(table);
+        } else {
+            do
+                table_pass_vacant_turns(table);
+            while (table_flush(table));
+        }
+        table->touched = 0;
+        if (table_is_finished(table))
+            table_pool_release(&server_tables, table);
     }
+    table_list_clear(&server_touched);
 }
 
 int server_is_idling() /* Hacky + spaghetti */
 {
-    int i;
-    for (i = 0; i < server_conn_len; i++) {
-        if (NETWORK_BUFFER_LEN(server_conns[i].sendbuff))
+    size_t i;
+    if (server_touched.len)
+        return 0;
+    for (i = 0; i < server_tables.active.len; i++) {
+        if (!table_is_idling(server_tables.active.elems[i]))
+            return 0;
+    }
+    for (i = 0; i < server_lobby.len; i++) {
+        if (NETWORK_SENDQ_LEN(server_lobby.elems[i]->pconn.sendq))
             return 0;
     }
     return 1;
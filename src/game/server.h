@@ -4,6 +4,8 @@
 #include "engine/system/network.h"
 
 #define NETMSG_VER 0
+#define NETMSG_VER_COMPACT 1
+#define NETMSG_VER_MAX NETMSG_VER_COMPACT
 #define DEFAULT_RECV_SIZE 400
 
 enum message_type {
@@ -11,18 +13,36 @@ enum message_type {
     MSG_GM_START,
     MSG_GM_STATE,
     MSG_GM_ACT,
+    MSG_LB_JOIN,
+    MSG_GM_DELTA,
+    MSG_GM_RESYNC,
 };
+/* GM_STATE and GM_DELTA payloads start with a u32 sequence number, a delta
+ * applies only on top of the previous one. A client that falls out of step
+ * sends an empty GM_RESYNC and is answered with a fresh GM_STATE.
+ * Both are a redacted public part shared by the whole table followed by a
+ * private segment holding the recipient's own cards */
 
+struct server_table;
 struct player_connection {
     int player_id;
     struct network_connection *conn;
-    struct network_buffer      sendbuff;
+    struct network_sendq       sendq;
+    unsigned short             version;
+    struct network_buffer      recvbuff;
     void (*recvmsg)(short type, const void *data);
+    struct server_table       *table;
+};
+
+/* seats of 0 lets the server pick any open table */
+struct lobby_join {
+    unsigned char seats;
 };
 
 void server_init(int port, int max_players);
+void server_set_replay_dir(const char *dir);
 void server_start_game();
-void server_update();
+void server_update(int timeout_ms);
 
 int server_register_local(void (*recvmsg)(short type, const void *data));
 int server_handle_act(struct act act);
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "engine/system/time.h"
+#include "engine/utils.h"
+#include "logic.h"
+
+#define SIM_DEFAULT_GAMES       10000
+#define SIM_DEFAULT_PLAYERS     4
+#define SIM_DEFAULT_DEAL        7
+#define SIM_DEFAULT_MAX_TURNS   5000
+#define SIM_THREAD_MAX          256
+
+/* Policies pick the next act for the active player, returning -1 when they have none.
+ * Each worker owns its rng stream, every game is seeded from it */
+typedef int (*sim_policy_fn)(const struct game_state *game, struct act *act, struct rng *rng);
+
+struct sim_policy {
+    const char     *name;
+    sim_policy_fn   fn;
+};
+
+struct sim_config {
+    long                        games;
+    int                         players;
+    int                         deal;
+    int                         max_turns;
+    int                         threads;
+    uint64_t                    seed;
+    const struct sim_policy    *seats[PLAYER_MAX];
+};
+
+struct sim_stats {
+    long                        games;
+    long                        unfinished;
+    long                        turns;
+    long                        acts;
+    long                        rejected;
+    long                        wins[PLAYER_MAX];
+};
+
+struct sim_worker {
+    pthread_t                   thread;
+    const struct sim_config    *config;
+    long                        games;
+    struct rng                  rng;
+    struct sim_stats            stats;
+};
+
+/* ALLOCATION COUNTING, linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc */
+static unsigned long sim_alloc_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    __sync_fetch_and_add(&sim_alloc_count, 1);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    __sync_fetch_and_add(&sim_alloc_count, 1);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    __sync_fetch_and_add(&sim_alloc_count, 1);
+    return __real_realloc(ptr, size);
+}
+
+/* POLICIES */
+static int policy_auto(const struct game_state *game, struct act *act, struct rng *rng)
+{
+    if (act_auto(game, act) == 0)
+        return 0;
+
+    act->type = ACT_END_TURN;
+    return game_state_can_act(game, *act) > 0 ? 0 : -1;
+}
+
+static int policy_random(const struct game_state *game, struct act *act, struct rng *rng)
+{
+    const struct card_list *hand = &game->players[game->active_player_index].hand;
+    struct act  options[1 + 1 + 256];
+    int         option_len = 0;
+    int         i;
+
+    act->type = ACT_DRAW;
+    if (game_state_can_act(game, *act) > 0)
+        options[option_len++] = *act;
+
+    act->type = ACT_END_TURN;
+    if (game_state_can_act(game, *act) > 0)
+        options[option_len++] = *act;
+
+    act->type = ACT_PLAY;
+    for (i = 0; i < hand->len && option_len < ARRAY_SIZE(options); i++) {
+        act->args.play.card_id = hand->elems[i].id;
+        act->args.play.color   = rng_range(rng, CARD_COLOR_MAX);
+        if (game_state_can_act(game, *act) > 0)
+            options[option_len++] = *act;
+    }
+
+    if (!option_len)
+        return -1;
+    *act = options[rng_range(rng, option_len)];
+    return 0;
+}
+
+static const struct sim_policy SIM_POLICIES[] = {
+    { "auto",   policy_auto },
+    { "random", policy_random },
+};
+
+static const struct sim_policy *sim_find_policy(const char *name)
+{
+    int i;
+    for (i = 0; i < ARRAY_SIZE(SIM_POLICIES); i++) {
+        if (strcmp(SIM_POLICIES[i].name, name) == 0)
+            return SIM_POLICIES + i;
+    }
+    return NULL;
+}
+
+/* SIMULATION */
+static void sim_play_game(const struct sim_config *config, struct game_state *game, struct rng *rng, struct sim_stats *stats)
+{
+    const struct sim_policy *policy;
+    struct act act;
+
+    game_state_init(game);
+    game_state_start(game, config->players, config->deal, rng_next64(rng));
+
+    while (!game->ended && game->turn < config->max_turns) {
+        policy = config->seats[game->active_player_index];
+        if (policy->fn(game, &act, rng) != 0 || game_state_act(game, act) != 0) {
+            /* A stuck policy forfeits its turn rather than spinning forever */
+            stats->rejected++;
+            act.type = game_state_can_act(game, (struct act){ .type = ACT_DRAW }) > 0 ? ACT_DRAW : ACT_END_TURN;
+            if (game_state_act(game, act) != 0)
+                break;
+        }
+        stats->acts++;
+    }
+
+    stats->games++;
+    stats->turns += game->turn;
+    if (game->ended)
+        stats->wins[game->active_player_index]++;
+    else
+        stats->unfinished++;
+    game_state_deinit(game);
+}
+
+static void *sim_worker_run(void *arg)
+{
+    struct sim_worker *worker = arg;
+    struct game_state  game;
+    long i;
+
+    for (i = 0; i < worker->games; i++)
+        sim_play_game(worker->config, &game, &worker->rng, &worker->stats);
+    return NULL;
+}
+
+static void sim_stats_merge(struct sim_stats *dst, const struct sim_stats *src)
+{
+    int i;
+
+    dst->games      += src->games;
+    dst->unfinished += src->unfinished;
+    dst->turns      += src->turns;
+    dst->acts       += src->acts;
+    dst->rejected   += src->rejected;
+    for (i = 0; i < PLAYER_MAX; i++)
+        dst->wins[i] += src->wins[i];
+}
+
+static void sim_print_usage(const char *exe)
+{
+    int i;
+
+    fprintf(stderr,
+            "usage: %s [-g games] [-p players] [-d deal] [-m max_turns] [-t threads] [-s seed] [-P policy[,policy...]]\n"
+            "policies:", exe);
+    for (i = 0; i < ARRAY_SIZE(SIM_POLICIES); i++)
+        fprintf(stderr, " %s", SIM_POLICIES[i].name);
+    fprintf(stderr, "\n");
+}
+
+static int sim_parse_policies(struct sim_config *config, char *list)
+{
+    const struct sim_policy *policy = NULL;
+    char *name;
+    int   i = 0;
+
+    for (name = strtok(list, ","); name && i < PLAYER_MAX; name = strtok(NULL, ","), i++) {
+        policy = sim_find_policy(name);
+        if (!policy) {
+            fprintf(stderr, "Unknown policy '%s'\n", name);
+            return -1;
+        }
+        config->seats[i] = policy;
+    }
+    /* The last named policy fills the remaining seats */
+    for (; i < PLAYER_MAX; i++)
+        config->seats[i] = policy;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sim_config   config = {
+        .games      = SIM_DEFAULT_GAMES,
+        .players    = SIM_DEFAULT_PLAYERS,
+        .deal       = SIM_DEFAULT_DEAL,
+        .max_turns  = SIM_DEFAULT_MAX_TURNS,
+        .threads    = sysconf(_SC_NPROCESSORS_ONLN),
+        .seed       = get_monotonic_time() * 1000,
+    };
+    struct sim_worker  *workers;
+    struct sim_stats    total = {0};
+    unsigned long       allocs_start;
+    double              start, elapsed;
+    int                 opt, i;
+
+    for (i = 0; i < PLAYER_MAX; i++)
+        config.seats[i] = SIM_POLICIES;
+
+    while ((opt = getopt(argc, argv, "g:p:d:m:t:s:P:h")) != -1) {
+        switch (opt) {
+            case 'g': config.games     = atol(optarg); break;
+            case 'p': config.players   = atoi(optarg); break;
+            case 'd': config.deal      = atoi(optarg); break;
+            case 'm': config.max_turns = atoi(optarg); break;
+            case 't': config.threads   = atoi(optarg); break;
+            case 's': config.seed      = strtoull(optarg, NULL, 0); break;
+            case 'P':
+                if (sim_parse_policies(&config, optarg) != 0)
+                    return 1;
+                break;
+            default:
+                sim_print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    config.players = max(2, min(config.players, PLAYER_MAX));
+    config.threads = max(1, min(config.threads, SIM_THREAD_MAX));
+    if (config.games < config.threads)
+        config.threads = config.games > 0 ? config.games : 1;
+
+    workers = calloc(config.threads, sizeof(struct sim_worker));
+    if (!workers)
+        return 1;
+
+    printf("Simulating %ld games, %d players, %d threads, seed %llu, seats:",
+            config.games, config.players, config.threads, (unsigned long long)config.seed);
+    for (i = 0; i < config.players; i++)
+        printf(" %s", config.seats[i]->name);
+    printf("\n");
+
+    allocs_start = sim_alloc_count;
+    start = get_monotonic_time();
+    for (i = 0; i < config.threads; i++) {
+        workers[i].config = &config;
+        workers[i].games  = config.games / config.threads + (i < config.games % config.threads);
+        rng_seed(&workers[i].rng, config.seed, i + 1);
+        if (pthread_create(&workers[i].thread, NULL, sim_worker_run, workers + i) != 0) {
+            fprintf(stderr, "Failed to spawn worker %d\n", i);
+            return 1;
+        }
+    }
+    for (i = 0; i < config.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        sim_stats_merge(&total, &workers[i].stats);
+    }
+    elapsed = get_monotonic_time() - start;
+
+    printf("games        %ld (%ld hit the %d turn cap)\n", total.games, total.unfinished, config.max_turns);
+    printf("elapsed      %.3f s\n", elapsed);
+    printf("games/s      %.1f\n", total.games / elapsed);
+    printf("turns/game   %.2f\n", (double)total.turns / total.games);
+    printf("acts/game    %.2f\n", (double)total.acts / total.games);
+    printf("rejected     %ld\n", total.rejected);
+    printf("allocs       %lu (%.2f per game)\n", sim_alloc_count - allocs_start,
+            (double)(sim_alloc_count - allocs_start) / total.games);
+    printf("wins        ");
+    for (i = 0; i < config.players; i++)
+        printf(" %ld", total.wins[i]);
+    printf("\n");
+
+    free(workers);
+    return 0;
+}